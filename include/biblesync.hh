@@ -63,6 +63,11 @@
 //		 string bible, string ref, string alt,
 //		 string group, string domain,
 //		 string info,  string dump)
+//	=> alternatively, setModeEvent(BSP_MODE_xyz, your_event_func,
+//	   userdata, "passphrase") delivers the same as one BibleSync_event,
+//	   whose string_view fields are valid only during the call:
+//		(const BibleSync_event &event, void *userdata)
+//	   event also carries the speaker as binary uuid_t, and the object.
 //		there are 6 your_void_nav_func() use cases, identified in cmd.
 //		non-error cases provide valid speakerkey (UUID), else it is "".
 //		1. 'A' (announce)
@@ -88,6 +93,9 @@
 //		   message in alt.
 //		7. 'E' (error) for network errors & malformed packets.
 //		   only info + dump are useful.
+//		   an event_func gets the reason as event.error, with only
+//		   the particulars (e.g. a missing header's name) in info:
+//		   getErrorText(event.error) localizes, when wanted.
 //
 // - get current mode.
 //	BibleSync_mode getMode().
@@ -112,16 +120,44 @@
 //	  sets outgoing TTL to zero so no one hears you off-machine.
 //	  applicable only to BSP_PERSONAL mode.
 //
-// - set beacon count based on frequency of calling Receive()
-//      void setBeaconCount(int);
-//        how often will your app call Receive()?
-//        divide 10 by that, call setBeaconCount(result).
+// - drop junk in the kernel
+//	bool setKernelFilter(bool);
+//	  a socket filter refuses malformed packets and our own echoes
+//	  before they are ever read.  linux only.  default off.
+//
+// - keep a flooding sender from starving your main loop
+//	void setRateLimit(uuid_rate, uuid_burst, source_rate, source_burst);
+//	  packets per second, after a burst, from one sender uuid and from
+//	  one address.  more are dropped unread, and counted.  0 (default)
+//	  is no limit.
+//
+// - send compact navigation and chat
+//	void setCompression(bool);
+//	  one byte per header name and common value; used only while every
+//	  peer heard says it can decode them.  default off.
+//	void setTLV(bool);
+//	  tag/length/value, cheapest of all to decode; likewise.
+//
+// - set beacon timing, in msec of real time
+//      void setBeaconInterval(unsigned int msec);
+//        how often our beacon goes out; default 10000, bounded [3000..10000].
+//      void setSpeakerTimeout(unsigned int msec);
+//        beacon silence before a speaker is dead; default 30000.
+//      (setBeaconCount() is obsolete: timing no longer depends on
+//       how often your app calls Receive().)
 //
 // - set new username
 //      void setUser(string);
 //        for apps (such as Bishop) which allow the user to set the friendly name
 //        and which may be changed at some point whle BibleSync runs.
 //
+// - choose how much packet dump nav_func is given
+//	void setDumpMode(BibleSync_dump_mode);
+//	  BSP_DUMP_ERRORS ('E' only, default), BSP_DUMP_ALWAYS, BSP_DUMP_OFF.
+//	  dump formatting costs time on every packet; apps that show every
+//	  dump ask for ALWAYS.  in any mode, string getDump() renders
+//	  the dump of the packet at hand when called from your_void_nav_func.
+//
 // - allow another speaker to drive us
 //	void listenToSpeaker(bool listen, string speakerkey)
 //		say yes/no to listening.
@@ -129,6 +165,36 @@
 // - send a human chat message to others listening.
 //	BibleSync_xmit_status retval = Chat("your message for others here");
 //	  sends your message to all other listeners. not restricted to Speakers.
+//	  a chat or verse list too long for one packet goes as several,
+//	  reassembled by current peers (see BSP_FRAGMENTS_MAX); with any
+//	  older peer about, it is cut to one packet instead.
+//
+// - hold navigation while the speaker scrolls.
+//	setCoalesce(quiet_ms, max_delay_ms);
+//	  Transmit() then holds only the latest navigation per group,
+//	  sent from Receive() once quiet for quiet_ms, or at most
+//	  max_delay_ms after first held.  0 (default) sends at once.
+//	Flush();
+//	  sends whatever is held, now.
+//
+// - send several messages at once, e.g. navigation for groups 1-9.
+//	int sent = TransmitBatch(records, count, statuses);
+//	  records are BibleSync_xmit_record, navigation or (if chat) chat.
+//	  each one's status is as Transmit() or Chat() would return.
+//	  all are sent together, with sendmmsg() on linux.
+//
+// - see what BibleSync has been doing, e.g. for a diagnostics page.
+//	BibleSync_stats stats = getStats();
+//	  stats.value[BSP_STAT_*] counts packets and bytes sent and
+//	  received, rejects by reason, events by cmd, speakers come & gone.
+//	  cheap, from any thread.  getStatName(BSP_STAT_*) labels each.
+//
+// - calm a storm of errors, e.g. from a broken device on the LAN
+//	void setErrorCoalesce(unsigned int interval_ms);
+//	  the first of an error from a sender is delivered at once; any
+//	  more just like it in the following interval_ms become one 'E'
+//	  when it ends, with event.repeats saying how many.  0 (default)
+//	  is off.
 //
 // Receive() USAGE NOTE:
 // the application must call BibleSync::Receive(YourBibleSyncObjPtr)
@@ -145,6 +211,41 @@
 // object context be re-entered.  the internal receive routine
 // is private.
 //
+// event-driven alternative to polling:
+// register getDescriptor() with your event loop (glib, epoll, libuv...)
+// for readability, and call Receive() when it is readable, and also
+// when getReceiveTimeout() msec have passed without traffic, so that
+// beacons and speaker aging stay on time.  or, from a thread of your own,
+// simply loop on BibleSync::Receive(YourBibleSyncObjPtr, timeout_msec),
+// which sleeps until traffic arrives or housekeeping falls due.
+// however Receive() is called, beacons and aging follow the clock.
+//
+// bursts of traffic need not stall your main loop: setReceiveBudget()
+// bounds the packets or msec one Receive() call may spend.  what is
+// left waits for the next call, and Receive() says so by returning
+// BSP_RECEIVE_MORE, which polling takes as TRUE.  an event-driven app
+// should call again soon; getReceiveTimeout() is then 0.
+//
+// receiver thread alternative:
+// setReceiverThread(true) has BibleSync run a thread of its own which
+// does all network reading, parsing, validation, aging and beacons
+// whenever a mode is enabled.  events are queued for your thread, and
+// Receive() becomes a cheap delivery of queued events to
+// your_void_nav_func, still on your thread.  keep calling it as before:
+// Receive(obj, timeout_msec) then sleeps until events are queued, and
+// getDescriptor() is readable when they are.
+// dumps are rendered in the receiver thread, only as setDumpMode() says.
+//
+// many sessions in one process, e.g. a server with a classroom each:
+// BibleSyncMux mux; mux.Add(&session) for each BibleSync object, then
+// call BibleSyncMux::Receive(&mux) (or with a timeout, or on readability
+// of mux.getDescriptor()) instead of each session's Receive().
+// one socket is read, each packet is checked and parsed once, and it
+// goes only to the sessions with its passphrase, each with its own mode
+// and speakers as always.  rejects and packets for passphrases no
+// session holds are only counted, in mux.getStats(): sessions see no 'E'
+// for bad packets, and no 'M' for others' passphrases.
+//
 // Note on speaker beacons:
 // Protocol operates using periodic (10sec) beacons of speaker availability.
 // By default, PERSONAL & AUDIENCE accepts listening to 1st announced speaker,
@@ -160,8 +261,15 @@
 // a mismatch.
 // Note also that Personal is both speaker and audience.
 
+#include <atomic>
 #include <map>
+#include <memory_resource>
+#include <mutex>
 #include <string>
+#include <string_view>
+#include <thread>
+#include <unordered_map>
+#include <vector>
 
 #include <memory.h>
 #include <stdio.h>
@@ -177,12 +285,18 @@
 #include <arpa/inet.h>
 #include <netinet/in.h>
 #include <sys/socket.h>
+#include <sys/uio.h>
 #include <uuid/uuid.h>
 #else
 #define	uuid_t	UUID
 #include <winsock2.h>
 #include <windows.h>
 #include <ws2tcpip.h>
+// no sendmsg(): gathered pieces are flattened for sendto().
+struct iovec {
+    void   *iov_base;
+    size_t  iov_len;
+};
 #endif
 
 using namespace std;
@@ -195,6 +309,13 @@ typedef enum _BibleSync_mode {
     N_BSP_MODE
 } BibleSync_mode;
 
+typedef enum _BibleSync_dump_mode {
+    BSP_DUMP_OFF,		// dump param always empty.
+    BSP_DUMP_ERRORS,		// dump param provided only for 'E'.
+    BSP_DUMP_ALWAYS,		// dump param provided for every event.
+    N_BSP_DUMP
+} BibleSync_dump_mode;
+
 typedef enum _BibleSync_xmit_status {
     BSP_XMIT_OK,
     BSP_XMIT_FAILED,
@@ -205,12 +326,72 @@ typedef enum _BibleSync_xmit_status {
     N_BSP_XMIT
 } BibleSync_xmit_status;
 
+// what an 'E' event is about.
+typedef enum _BibleSync_error {
+    BSP_ERROR_NONE,			// not an error.
+    BSP_ERROR_NETWORK_SETUP,		// failed calls in dump.
+    BSP_ERROR_NETWORK_CHANGE,		// likewise.
+    BSP_ERROR_RECEIVE,			// socket read; failed call in info.
+    BSP_ERROR_TRANSMIT,			// send failed: now disabled.
+    BSP_ERROR_EVENTS_LOST,		// receiver thread's queue; count.
+    BSP_ERROR_BAD_SIZE,			// malformed packets, as BSP_STAT_*.
+    BSP_ERROR_BAD_MAGIC,
+    BSP_ERROR_BAD_VERSION,
+    BSP_ERROR_BAD_TYPE,
+    BSP_ERROR_BAD_COUNT,
+    BSP_ERROR_BAD_INDEX,
+    BSP_ERROR_BAD_BODY,
+    BSP_ERROR_MISSING_HEADER,		// header name.
+    BSP_ERROR_BAD_DOMAIN,		// domain as arrived.
+    BSP_ERROR_BAD_GROUP,		// group as arrived.
+    N_BSP_ERROR
+} BibleSync_error;
+
 // args: cmd, speakerkey, bible, verse, alt, group, domain, info, dump.
 typedef void (*BibleSync_navigate)(char,   string,
 				   string, string, string,
 				   string, string,
 				   string, string);
 
+class BibleSync;
+class BibleSyncMux;
+
+// args of BibleSync_navigate, as one event, without copies.
+// the views point into the received packet or into BibleSync's own
+// storage, and are valid only for the duration of the callback:
+// copy whatever is to be kept.
+typedef struct _BibleSync_event {
+    char        cmd;
+    uuid_t      speaker;		// binary speakerkey; zero if none.
+    string_view speakerkey;		// printable; empty if none.
+    string_view bible;
+    string_view ref;
+    string_view alt;
+    string_view group;
+    string_view domain;
+    string_view info;
+    string_view dump;			// only as dump mode provides.
+    BibleSync  *object;			// e.g. object->getDump().
+    BibleSync_error error;		// 'E' only; else BSP_ERROR_NONE.
+    uint32_t    repeats;		// 'E': more since, coalesced.
+    string_view source;			// 'E' about a packet: its sender.
+} BibleSync_event;
+
+// args: event, userdata as given to setModeEvent().
+typedef void (*BibleSync_event_func)(const BibleSync_event &, void *);
+
+// one message for TransmitBatch(): navigation, as for Transmit(),
+// or, if chat, message alone, as for Chat().  defaults as Transmit()'s.
+typedef struct _BibleSync_xmit_record {
+    bool        chat    = false;
+    string_view bible   = "KJV";
+    string_view ref     = "Gen.1.1";
+    string_view alt     = "";
+    string_view group   = "1";
+    string_view domain  = "BIBLE-VERSE";
+    string_view message = "";
+} BibleSync_xmit_record;
+
 #ifndef TRUE
 #define TRUE 1
 #define FALSE 0
@@ -228,6 +409,74 @@ typedef void (*BibleSync_navigate)(char,   string,
 #define	BSP_HEADER_SIZE	32
 #define	BSP_MAX_PAYLOAD	(BSP_MAX_SIZE - BSP_HEADER_SIZE)
 
+// fragmentation: a body too long for one packet goes as up to
+// BSP_FRAGMENTS_MAX packets, all but the last carrying exactly
+// BSP_MAX_PAYLOAD, tied together by sender uuid and a message id
+// in reserved[0..1].  num_packets and index_packet say where each goes.
+// peers before this refuse num_packets other than 1, so a long body is
+// split only when every peer heard advertises BSP_CAP_FRAGMENTS; else
+// it is cut to one packet, as it always was.
+#define	BSP_FRAGMENTS_MAX	8
+#define	BSP_MAX_MESSAGE		(BSP_FRAGMENTS_MAX * BSP_MAX_PAYLOAD)
+#define	BSP_FRAGMENTS(length)	\
+	(((length) <= BSP_MAX_PAYLOAD) ? 1 : \
+	 (((length) + BSP_MAX_PAYLOAD - 1) / BSP_MAX_PAYLOAD))
+
+// capabilities and body encoding, in reserved bytes old peers ignore.
+// every packet we send advertises what we decode, in reserved[2];
+// reserved[3] says how this packet's body is encoded.  we send other
+// than text only when asked to, and only when every peer we have heard
+// advertises that it decodes it.  presence and beacons are always text,
+// so that every peer can know we are here.
+#define	BSP_RES_CAPS		2
+#define	BSP_RES_BODY		3
+#define	BSP_CAP_COMPRESSED	0x01	// decodes BSP_BODY_COMPRESSED.
+#define	BSP_CAP_TLV		0x02	// decodes BSP_BODY_TLV.
+#define	BSP_CAP_FRAGMENTS	0x04	// reassembles num_packets > 1.
+#define	BSP_CAP_BITS		8
+#define	BSP_BODY_TEXT		0	// name=value\n, as always.
+#define	BSP_BODY_COMPRESSED	1	// token per name, see below.
+#define	BSP_BODY_TLV		2	// tag, length, value: see below.
+#define	BSP_PEERS_MAX		1024	// beyond, peers are assumed old.
+
+// receive rate limits: a token bucket per sender uuid and per source
+// address, each table bounded.  a packet costs BSP_LIMIT_TOKEN.
+#define	BSP_LIMIT_BUCKETS	256
+#define	BSP_LIMIT_TOKEN		1000	// so that refill is in whole msec.
+
+// compressed body: lines of one token byte, BSP_TOKEN_NAME + BSP_FIELD_*,
+// standing for "name=", then the value and newline as in text.  a value
+// of one byte, 1..BSP_TOKEN_VALUES, stands for a common value.  there is
+// no app.inst.uuid line: the header uuid is the same thing.
+#define	BSP_TOKEN_NAME		0x80
+#define	BSP_TOKEN_VALUES	4	// BIBLE-VERSE, Linux, Windows, UNIX.
+
+// TLV body: records of one tag byte, the same tokens as above, then the
+// value's length in 2 bytes, network order, then the value itself, with
+// no terminator and no escaping.  decoding needs no searching at all.
+// unknown tags are skipped; there is no app.inst.uuid record either.
+#define	BSP_TLV_HEADER		3
+#define	BSP_TLV_PREFIX_MAX	(BSP_MAX_MESSAGE / 2)
+
+// reassembly bounds: an incomplete message is dropped after
+// BSP_REASSEMBLY_MSEC, a sender may have BSP_REASSEMBLY_SENDER in
+// progress, and all of them together hold at most BSP_REASSEMBLY_BYTES.
+#define	BSP_REASSEMBLY_MSEC	3000
+#define	BSP_REASSEMBLY_SENDER	4
+#define	BSP_REASSEMBLY_BYTES	(64 * BSP_MAX_MESSAGE)
+
+// per-object scratch for text composed while handling one packet:
+// a full dump, a decoded body, and every event's strings, with room.
+#define	BSP_ARENA_SIZE		(12 * BSP_MAX_SIZE)
+
+// errors coalesced at once, by kind, detail and sender; the oldest
+// gives way.
+#define	BSP_ERROR_SENDERS	16
+#define	BSP_ERROR_DETAIL	64
+
+// how often, at most, to look for network changes (see InterfaceAddress).
+#define	BSP_INTERFACE_CHECK_MSEC	1000
+
 // message indications
 #define	BSP_MAGIC		htonl(0x409CAF11)
 #define	BSP_PROTOCOL		3
@@ -240,9 +489,33 @@ typedef void (*BibleSync_navigate)(char,   string,
 #define	BSP_CHAT	4	// human chat message.
 // beacon packet is identical to presence announcement except for type.
 
+// receive batching: most packets taken per recvmmsg(2).
+#define	BSP_RECV_BATCH	16
+
+// Receive() return: its budget ran out with packets still waiting.
+// true, as TRUE is: polling goes on, and should come back soon.
+#define	BSP_RECEIVE_MORE	2
+#define	BSP_XMIT_BATCH	16	// TransmitBatch() sends per syscall.
+
 // beacon constants
-#define	BSP_BEACON_COUNT	10	// xmit every N calls of Receive().
+#define	BSP_BEACON_COUNT	10	// obsolete: see setBeaconCount().
 #define	BSP_BEACON_MULTIPLIER	3	// multiplier for aging to death.
+#define	BSP_BEACON_MSEC		10000	// our beacon interval, default.
+#define	BSP_BEACON_MSEC_MIN	3000
+#define	BSP_BEACON_MSEC_MAX	10000
+#define	BSP_SPEAKER_TIMEOUT_MAX	600000	// longest speaker silence allowed.
+
+// speaker aging: a 2-level timer wheel.  level 0 slots are
+// BSP_WHEEL_MSEC apart, level 1 slots are BSP_WHEEL_SLOTS level 0
+// spans apart: about 16sec and 17min of reach.
+#define	BSP_WHEEL_MSEC		250
+#define	BSP_WHEEL_BITS		6
+#define	BSP_WHEEL_SLOTS		(1 << BSP_WHEEL_BITS)
+#define	BSP_WHEEL_LEVELS	2
+
+// receiver thread constants
+#define	BSP_EVENT_QUEUE		256	// events held for the app's thread.
+#define	BSP_RECEIVER_WAKE_MSEC	250	// longest wait before noticing stop.
 
 // message content names.
 #define BSP_APP_NAME			"app.name"		// req'd
@@ -259,6 +532,71 @@ typedef void (*BibleSync_navigate)(char,   string,
 #define BSP_MSG_PASSPHRASE		"msg.sync.passPhrase"	// req'd
 #define BSP_MSG_CHAT			"msg.chat"		// req'd for BSP_CHAT
 
+// indices of known message content names, as located in received bodies.
+typedef enum _BibleSync_field {
+    BSP_FIELD_APP_NAME,
+    BSP_FIELD_APP_VERSION,
+    BSP_FIELD_APP_INSTANCE_UUID,
+    BSP_FIELD_APP_OS,
+    BSP_FIELD_APP_DEVICE,
+    BSP_FIELD_APP_USER,
+    BSP_FIELD_MSG_SYNC_DOMAIN,
+    BSP_FIELD_MSG_SYNC_VERSE,
+    BSP_FIELD_MSG_SYNC_ALTVERSE,
+    BSP_FIELD_MSG_SYNC_BIBLEABBREV,
+    BSP_FIELD_MSG_SYNC_GROUP,
+    BSP_FIELD_MSG_PASSPHRASE,
+    BSP_FIELD_MSG_CHAT,
+    N_BSP_FIELD
+} BibleSync_field;
+
+#define	BSP_FIELD_BIT(f)	(1U << (f))
+
+// runtime statistics, indices into BibleSync_stats.
+typedef enum _BibleSync_stat {
+    BSP_STAT_RECV_ANNOUNCE,		// received, by type.
+    BSP_STAT_RECV_SYNC,
+    BSP_STAT_RECV_BEACON,
+    BSP_STAT_RECV_CHAT,
+    BSP_STAT_RECV_BYTES,
+    BSP_STAT_SENT_ANNOUNCE,		// sent, by type.
+    BSP_STAT_SENT_SYNC,
+    BSP_STAT_SENT_BEACON,
+    BSP_STAT_SENT_CHAT,
+    BSP_STAT_SENT_BYTES,
+    BSP_STAT_SEND_FAILED,
+    BSP_STAT_BAD_SIZE,			// validation failures.
+    BSP_STAT_BAD_MAGIC,
+    BSP_STAT_BAD_VERSION,
+    BSP_STAT_BAD_TYPE,
+    BSP_STAT_BAD_COUNT,			// packet count or index.
+    BSP_STAT_BAD_BODY,
+    BSP_STAT_MISSING_HEADER,		// packets, not headers.
+    BSP_STAT_SPOOF,
+    BSP_STAT_ECHO,
+    BSP_STAT_EVENT_A,			// callbacks, by cmd.
+    BSP_STAT_EVENT_N,
+    BSP_STAT_EVENT_S,
+    BSP_STAT_EVENT_D,
+    BSP_STAT_EVENT_C,
+    BSP_STAT_EVENT_M,
+    BSP_STAT_EVENT_E,
+    BSP_STAT_SPEAKERS_ADDED,
+    BSP_STAT_SPEAKERS_EXPIRED,
+    BSP_STAT_UNROUTED,			// BibleSyncMux: no such passphrase.
+    BSP_STAT_FRAGMENTS,			// received as parts of messages.
+    BSP_STAT_REASSEMBLED,		// whole messages made of them.
+    BSP_STAT_FRAGMENTS_DROPPED,		// inconsistent, late, or evicted.
+    BSP_STAT_KERNEL_DROPPED,		// by setKernelFilter(), or overrun.
+    BSP_STAT_ERRORS_COALESCED,		// 'E' not delivered, but counted.
+    BSP_STAT_RATE_LIMITED,		// by setRateLimit().
+    N_BSP_STAT
+} BibleSync_stat;
+
+typedef struct _BibleSync_stats {
+    uint64_t value[N_BSP_STAT];		// since object creation.
+} BibleSync_stats;
+
 // required number of fields to send (out) or verify (in).
 #define	BSP_FIELDS_RECV_ANNOUNCE	4
 #define	BSP_FIELDS_RECV_CHAT		5
@@ -282,10 +620,13 @@ typedef void (*BibleSync_navigate)(char,   string,
 
 class BibleSync {
 
-private:
+    // test/biblesync-bench.cc times the private packet path.
+    friend class BibleSyncBench;
 
-    // simple name/value pairs.
-    typedef std::map < string, string > BibleSyncContent;
+    // a multiplexer reads and checks packets for its sessions.
+    friend class BibleSyncMux;
+
+private:
 
     typedef struct _BibleSyncMessage {
 	uint32_t  magic;
@@ -298,15 +639,31 @@ private:
 	char      body[BSP_MAX_PAYLOAD+1];	// +1 for stuffing '\0'.
     } BibleSyncMessage;
 
+    // received body content, located in place: views into the packet.
+    typedef struct _BibleSyncFields {
+	uint32_t    present;			// BSP_FIELD_BIT()s found.
+	string_view value[N_BSP_FIELD];
+    } BibleSyncFields;
+
     typedef struct _BibleSyncSpeaker {
+	uuid_t    uuid;				// key: origin uuid, binary.
+	bool      used;				// slot occupied.
 	bool      listen;			// nav for this guy?
-	uint8_t   countdown;			// lifetime aging.
-	string    addr;				// for spoof check.
+	uint64_t  deadline;			// monotonic msec of death.
+	uint32_t  serial;			// matches its wheel timer.
+	struct in_addr addr;			// for spoof check.
     } BibleSyncSpeaker;
 
-    // key string is origin uuid.
-    typedef std::map < string, BibleSyncSpeaker > BibleSyncSpeakerMap;
-    typedef BibleSyncSpeakerMap::iterator BibleSyncSpeakerMapIterator;
+    // speakers, in an open-addressing table keyed by binary uuid:
+    // linear probing, power-of-2 size, at most half full.
+    // printable uuids are made only for the app's benefit.
+#define	BSP_SPEAKER_TABLE_MIN	16
+    std::vector<BibleSyncSpeaker> speakers;
+    unsigned int speaker_count;
+    unsigned int SpeakerSlot(const uuid_t &u);
+    BibleSyncSpeaker *FindSpeaker(const uuid_t &u);
+    BibleSyncSpeaker &AddSpeaker(const uuid_t &u);
+    void RemoveSpeaker(BibleSyncSpeaker *speaker);
 
     // self identification.
     string BibleSync_version;
@@ -318,33 +675,140 @@ private:
     string device;
 
     // currently processing received navigation.
-    // prevents use of Transmit.
-    bool receiving;
+    // prevents use of Transmit.  set on the app's thread as queued
+    // events are delivered, and read on the receiver thread too.
+    std::atomic<bool> receiving;
+
+    // when xmit-capable, we xmit BSP_BEACON every beacon_msec.
+    // times are monotonic msec, immune to wall clock changes.
+    unsigned int beacon_msec;
+    unsigned int speaker_timeout;	// beacon silence => dead.
+    uint64_t next_beacon;		// 0: we send none.
+    uint64_t next_tick;		// of next Housekeeping(); 0: none due.
+    void Reschedule(void);
+
+    // speaker aging: each speaker has one timer in the wheel.
+    // a beacon only moves its deadline; a timer found early
+    // is re-inserted at the deadline, so aging costs only as
+    // much as what expires, not a walk of every speaker.
+    typedef struct _BibleSyncTimer {
+	uuid_t   uuid;
+	uint32_t serial;			// stale if speaker's differs.
+    } BibleSyncTimer;
+    std::vector<BibleSyncTimer> wheel[BSP_WHEEL_LEVELS][BSP_WHEEL_SLOTS];
+    std::vector<BibleSyncTimer> wheel_dead;	// kept: no allocation.
+    uint64_t wheel_now;			// last wheel tick processed.
+    uint32_t speaker_serial;
+    void WheelInsert(const BibleSyncTimer &timer, uint64_t deadline);
+    uint64_t WheelNext(void);		// msec of next busy tick; 0: none.
 
-    // when xmit-capable, we xmit BSP_BEACON every N calls of Receive().
-    uint8_t beacon_countdown;	// progress toward our next beacon xmit
-    uint8_t beacon_count;	// how many Receive() calls between beacon xmits
+    // sender-side coalescing: latest navigation per group, held until
+    // quiet for coalesce_quiet msec, or at most coalesce_max msec old.
+    typedef struct _BibleSyncPending {
+	string   bible;
+	string   ref;
+	string   alt;
+	string   domain;
+	uint64_t first;		// monotonic msec of first held Transmit().
+	uint64_t last;		// ...and of the latest.
+    } BibleSyncPending;
+    std::map<string, BibleSyncPending, std::less<>> pending;	// by group.
+    unsigned int coalesce_quiet;	// 0: no coalescing.
+    unsigned int coalesce_max;
+    BibleSync_xmit_status TransmitCoalesce(string_view bible,
+					   string_view ref,
+					   string_view alt,
+					   string_view group,
+					   string_view domain);
+    void FlushCoalesced(bool all);
+    uint64_t CoalesceDue(void);		// earliest flush; 0 if none.
+
+    // receiver-side coalescing: repeats of an error from one sender,
+    // the same in kind and detail, counted over error_interval msec
+    // and then reported once.
+    typedef struct _BibleSyncErrorSeen {
+	BibleSync_error error;		// BSP_ERROR_NONE: free.
+	struct in_addr  addr;
+	uint64_t        since;		// monotonic msec the interval began.
+	uint32_t        repeats;
+	size_t          detail_hash;	// of all of it; the text may be cut.
+	char            detail[BSP_ERROR_DETAIL];
+    } BibleSyncErrorSeen;
+    BibleSyncErrorSeen errors_seen[BSP_ERROR_SENDERS];
+    unsigned int error_interval;	// 0: no coalescing.
+    void ReportError(BibleSync_error error, string_view detail,
+		     const struct sockaddr_in *source,
+		     const uuid_t *speaker = NULL,
+		     string_view speakerkey = "",
+		     string_view bible = "", string_view ref = "",
+		     string_view alt = "", string_view group = "",
+		     string_view domain = "", string_view dump = "");
+    void ReportRepeats(BibleSyncErrorSeen &seen);
+    void FlushErrors(bool all);
+    uint64_t ErrorsDue(void);		// earliest flush; 0 if none.
+
+    // the error being reported, for Dispatch() to pass along.
+    BibleSync_error error_at_hand;
+    uint32_t error_repeats;
+    char error_source[INET_ADDRSTRLEN];
 
-    // track currently-known speaker set.
-    BibleSyncSpeakerMap speakers;
 
     // what operational mode we're in.
     BibleSync_mode mode;
 
     // callback by which Receive induces navigation.
+    // either the legacy nav_func or event_func, never both.
     BibleSync_navigate nav_func;
+    BibleSync_event_func event_func;
+    void *event_data;
+    inline bool HasCallback(void)
+    {
+	return ((nav_func != NULL) || (event_func != NULL));
+    }
+
+    BibleSync_mode SetModeInternal(BibleSync_mode m,
+				   BibleSync_navigate n,
+				   BibleSync_event_func e,
+				   void *userdata,
+				   string p);
 
     // privacy
     string passphrase;
 
     // network access
-    struct sockaddr_in server, client;
+    struct sockaddr_in client;
     int server_fd, client_fd;
-    struct ip_mreq multicast_req;
+    static int OpenListener(struct in_addr interface, string &errors);
+
+    // kernel-side junk filter on a receive socket: what CheckPacket()
+    // refuses for fixed header values, and our own echo, if own is given.
+    // and what the kernel has dropped there, before we could see it.
+    bool kernel_filter;
+    static bool AttachFilter(int fd, bool filter, const uuid_t *own);
+    static uint64_t KernelDrops(int fd);
+
+    // when set, server_fd is unused: the multiplexer receives for us.
+    BibleSyncMux *mux;
 
     // default address discoverer, for multicast configuration.
+    // the address is resolved once per process and shared by all
+    // objects, until the network changes: on linux an rtnetlink
+    // subscription says so, and anywhere a failed transmit does.
+    // a changed address is followed in place, sockets and all.
     void InterfaceAddress();
     struct in_addr interface_addr;
+    uint64_t interface_generation;		// of interface_addr.
+    uint64_t next_interface_check;
+    bool recovering;				// from a failed send.
+    void FollowInterface(void);
+    bool MoveInterface(void);
+    bool TransmitRecover(void);
+    static struct in_addr ResolveInterface(void);
+    static struct in_addr CachedInterface(uint64_t &generation);
+    static bool InterfaceDue(uint64_t &next_check);
+    static bool InterfaceChanged(uint64_t generation);
+    static void InterfaceLost(void);
+    static bool Rejoin(int fd, struct in_addr from, struct in_addr to);
 
     // unique identification.
     uuid_t uuid;
@@ -357,30 +821,309 @@ private:
     void Shutdown();
 
     // real receiver.
-    int ReceiveInternal();		// C++ object context.
-    int InitSelectRead(char *, struct sockaddr_in *, BibleSyncMessage *);
+    int ReceiveInternal(bool timed = false,
+			int timeout_ms = 0);	// C++ object context.
+    void WaitReadable(int timeout_ms);
+    void Housekeeping();		// beacon & aging, when due.
+    int ReceiveBatch(int want = BSP_RECV_BATCH);
+    static int ReadBatch(int fd,
+			 BibleSyncMessage *buffer,
+			 struct sockaddr_in *source,
+			 int *length,
+			 const char *&failure,
+			 int want = BSP_RECV_BATCH);
+    static bool Readable(int fd);
+
+    // work allowed per Receive(), and a batch it left part-handled,
+    // to be taken up first next time.
+    typedef struct _BibleSyncBudget {
+	unsigned int packets = 0;		// 0: no limit.
+	unsigned int msec = 0;			// 0: no limit.
+	int held = 0;				// packets in the batch...
+	int next = 0;				// ...and next to handle.
+	unsigned int handled = 0;		// in this Receive()...
+	uint64_t stop = 0;			// ...which ends by then.
+    } BibleSyncBudget;
+    BibleSyncBudget budget;
+    static void BudgetStart(BibleSyncBudget &b);
+    static bool BudgetSpent(const BibleSyncBudget &b);
+    static int BudgetBatch(const BibleSyncBudget &b);
+    void ReceivePacket(BibleSyncMessage &bsp,
+		       int recv_size,
+		       struct sockaddr_in &source);
+    // a received message, whole: one packet, or reassembled fragments.
+    typedef struct _BibleSyncReceived {
+	const BibleSyncMessage *header;
+	const char *body;
+	int length;				// of body.
+	BibleSyncFields fields;
+	char uuid_text[BSP_UUID_PRINT_LENGTH];	// for compressed bodies.
+    } BibleSyncReceived;
+
+    // a message whose fragments are still arriving.
+    typedef struct _BibleSyncPartial {
+	BibleSyncMessage header;		// of its first fragment heard.
+	struct in_addr addr;			// sender, as heard from.
+	uint16_t  id;				// reserved[0..1].
+	uint16_t  total;			// num_packets.
+	uint32_t  seen;				// bit per index_packet.
+	int       length;			// of body, once last is seen.
+	uint64_t  deadline;			// monotonic msec of dropping.
+	std::vector<char> body;			// total * BSP_MAX_PAYLOAD + 1.
+    } BibleSyncPartial;
+
+    // all messages in progress, within BSP_REASSEMBLY_* bounds,
+    // and the last one made whole.
+    typedef struct _BibleSyncReassembly {
+	std::vector<BibleSyncPartial> partial;
+	size_t    bytes = 0;			// of all partial bodies.
+	uint64_t  dropped = 0;			// fragments, not yet counted.
+	BibleSyncMessage header;
+	std::vector<char> whole;
+	int       length = 0;
+    } BibleSyncReassembly;
+
+    // every sender heard, and what it can decode: the count of peers
+    // lacking each capability says whether we may use it.  never aged,
+    // as a silent audience is still there.  counts are read by senders,
+    // perhaps while a multiplexer's receiver writes them.
+    typedef struct _BibleSyncPeers {
+	std::unordered_map<uint64_t, uint8_t> caps;	// by folded uuid.
+	std::atomic<unsigned int> lacking[BSP_CAP_BITS] = {};
+	std::atomic<bool> overflow{false};	// more than BSP_PEERS_MAX.
+    } BibleSyncPeers;
+    static void PeerHeard(BibleSyncPeers &peers, const BibleSyncMessage &bsp);
+    static bool PeersCapable(const BibleSyncPeers &peers, uint8_t cap);
+
+    // senders' allowance, as token buckets by sender uuid or address.
+    // a bucket that has refilled is as good as none: those go first
+    // when the table is full, else the one longest unheard.
+    typedef struct _BibleSyncBucket {
+	uint64_t tokens;			// BSP_LIMIT_TOKEN per packet.
+	uint64_t last;				// monotonic msec of refill.
+    } BibleSyncBucket;
+    typedef struct _BibleSyncLimit {
+	unsigned int rate = 0;			// packets/sec; 0: no limit.
+	unsigned int burst = 0;			// packets, when refilled.
+	std::unordered_map<uint64_t, BibleSyncBucket> buckets;
+    } BibleSyncLimit;
+    static bool Admit(BibleSyncLimit &limit, uint64_t key, uint64_t now);
+    static void SetLimit(BibleSyncLimit &limit,
+			 unsigned int rate, unsigned int burst);
+
+    // what is known of the network: shared, under a multiplexer.
+    typedef struct _BibleSyncInbound {
+	BibleSyncReassembly reassembly;
+	BibleSyncPeers peers;
+	BibleSyncLimit by_uuid;
+	BibleSyncLimit by_source;
+    } BibleSyncInbound;
+    BibleSyncInbound inbound;
+    inline BibleSyncPeers &Peers(void);
+
+    static bool Reassemble(BibleSyncReassembly &r,
+			   const BibleSyncMessage &bsp,
+			   int recv_size,
+			   const struct sockaddr_in &source,
+			   uint64_t now);
+    static void DropPartial(BibleSyncReassembly &r, size_t i);
+
+    static BibleSync_stat CheckPacket(BibleSyncMessage &bsp,
+				      int recv_size,
+				      const struct sockaddr_in &source,
+				      bool own,
+				      BibleSyncInbound &in,
+				      std::atomic<uint64_t> *stats,
+				      BibleSyncReceived &message);
+    void RejectPacket(BibleSync_stat reject,
+		      const BibleSyncMessage &bsp,
+		      const BibleSyncFields &fields,
+		      const struct sockaddr_in &source);
+    void AcceptPacket(const BibleSyncMessage &bsp,
+		      const BibleSyncFields &fields,
+		      struct sockaddr_in &source);
+
+    // reusable receive buffers, filled as a batch by ReceiveBatch().
+    BibleSyncMessage recv_buffer[BSP_RECV_BATCH];
+    struct sockaddr_in recv_source[BSP_RECV_BATCH];
+    int recv_length[BSP_RECV_BATCH];
+    static bool ParseBody(const char *body, int length,
+			  BibleSyncFields &fields);
+    static bool ParseCompressed(const char *body, int length,
+				BibleSyncFields &fields);
+    static bool ParseTLV(const char *body, int length,
+			 BibleSyncFields &fields);
+    static bool ParseEncoded(const BibleSyncMessage &bsp,
+			     const char *body, int length,
+			     BibleSyncFields &fields, char *uuid_text);
+
+    // event delivery to nav_func, with dump as dump_mode requires.
+    // speaker is speakerkey in binary, or NULL if there is none.
+    void Deliver(char cmd, const uuid_t *speaker, string_view speakerkey,
+		 string_view bible, string_view ref, string_view alt,
+		 string_view group, string_view domain,
+		 string_view info,
+		 bool xmit_lock = false);
+    void Dispatch(char cmd, const uuid_t *speaker, string_view speakerkey,
+		  string_view bible, string_view ref, string_view alt,
+		  string_view group, string_view domain,
+		  string_view info, string_view dump,
+		  bool xmit_lock = false);
+    void DeliverEvent(const BibleSync_event &event, bool xmit_lock);
+    string_view RenderDump(void);
+
+    // per-packet text: what is composed for delivery, and the dump,
+    // comes from here and is released as the next packet starts.
+    // beyond BSP_ARENA_SIZE it spills to the heap, released likewise.
+    alignas(std::max_align_t) char arena_buffer[BSP_ARENA_SIZE];
+    std::pmr::monotonic_buffer_resource arena;
+    string_view Compose(std::initializer_list<string_view> pieces);
+    inline void ArenaReset(void) { arena.release(); }
+    bool ReceiveDrain(void);
+    void ReceiveDone(void);
+    inline void CountReceived(const BibleSyncMessage &bsp, int recv_size)
+    {
+	Count(BSP_STAT_RECV_BYTES, recv_size);
+	if ((recv_size >= BSP_HEADER_SIZE) &&
+	    (bsp.msg_type >= BSP_ANNOUNCE) && (bsp.msg_type <= BSP_CHAT))
+	    Count((BibleSync_stat)(BSP_STAT_RECV_ANNOUNCE +
+				   bsp.msg_type - BSP_ANNOUNCE));
+    }
+
+    // optional receiver thread, and its queue of events for the app.
+    // one producer (the thread), one consumer (the app, in Receive()).
+    typedef struct _BibleSyncQueuedEvent {
+	char   cmd;
+	uuid_t speaker;
+	string speakerkey;
+	string bible, ref, alt, group, domain;
+	string info, dump;
+	bool   xmit_lock;
+	BibleSync_error error;
+	uint32_t repeats;
+	char   source[INET_ADDRSTRLEN];
+    } BibleSyncQueuedEvent;
+
+    std::thread receiver;
+    std::thread::id receiver_id;
+    bool receiver_wanted;			// app asked for it.
+    std::atomic<bool> receiver_stop;		// please exit.
+    std::atomic<bool> shutdown_pending;		// thread's xmit failed.
+    std::vector<BibleSyncQueuedEvent> event_queue;
+    std::atomic<uint32_t> queue_head;		// next to deliver.
+    std::atomic<uint32_t> queue_tail;		// next to fill.
+    std::atomic<uint32_t> queue_lost;		// dropped when full.
+    bool dispatching;
+    const string *dispatch_dump;		// dump of event being delivered.
+
+    // the app's wakeup: a byte in the pipe when the queue gains events
+    // since the app last looked.  armed by the app, fired by the thread.
+    int wake_fd[2];
+    std::atomic<bool> wake_armed;
+    void Wake(void);
+    void ArmWake(void);
+    void WaitQueued(int timeout_ms);
+
+    // counters behind getStats(): relaxed, so never a hot path cost.
+    std::atomic<uint64_t> stats[N_BSP_STAT];
+    inline void Count(BibleSync_stat s, uint64_t n = 1)
+    {
+	stats[s].fetch_add(n, std::memory_order_relaxed);
+    }
+
+    // guards speakers and xmit against the receiver thread.
+    std::recursive_mutex state_lock;
+
+    void StartReceiver();
+    void StopReceiver();
+    bool OnReceiverThread();
+    void ReceiverThread();
+    void DispatchQueue();
+
+    // packet dump: what to provide, and what packet to render from.
+    BibleSync_dump_mode dump_mode;
+    const BibleSyncMessage *dump_packet;
+    const char *dump_body;			// reassembled, or in packet.
+    const struct sockaddr_in *dump_source;
+    int dump_size;
 
     // real transmitter.
     BibleSync_xmit_status
     TransmitInternal(char message_type = BSP_SYNC,
-		     string bible  = "KJV",
-		     string ref    = "Gen.1.1",
-		     string alt    = "",
-		     string group  = "1",
-		     string domain = "BIBLE-VERSE");
+		     string_view bible  = "KJV",
+		     string_view ref    = "Gen.1.1",
+		     string_view alt    = "",
+		     string_view group  = "1",
+		     string_view domain = "BIBLE-VERSE");
+
+    // one outbound packet, as pieces for gather I/O: header, prefix,
+    // 3 per content field, final newline if cut short.
+#define	BSP_XMIT_IOV_MAX	(3 + 3 * (BSP_FIELDS_XMIT_SYNC -	\
+					  BSP_FIELDS_XMIT_ANNOUNCE))
+    typedef struct _BibleSyncGather {
+	uint8_t      header[BSP_HEADER_SIZE];
+	char         chat[BSP_MAX_MESSAGE];	// chat with \n made \t.
+	uint8_t      tlv[BSP_FIELDS_XMIT_SYNC - BSP_FIELDS_XMIT_ANNOUNCE]
+			[BSP_TLV_HEADER];	// tag and length, per field.
+	struct iovec iov[BSP_XMIT_IOV_MAX];
+	int          count;
+	size_t       length;			// of body, after header.
+    } BibleSyncGather;
+
+    // one packet as sent: a gathered message, or a fragment of one.
+    // body pieces still point into the gather they came from.
+    typedef struct _BibleSyncPacket {
+	uint8_t      header[BSP_HEADER_SIZE];
+	struct iovec iov[BSP_XMIT_IOV_MAX];
+	int          count;
+    } BibleSyncPacket;
+    uint16_t fragment_id;			// last message id used.
+    int Fragment(const BibleSyncGather &gather, BibleSyncPacket *packet);
+    std::vector<BibleSyncGather> xmit_batch;	// TransmitBatch()'s, made once.
+    BibleSync_xmit_status TransmitCheck(char message_type);
+    void TransmitFailed(void);
+    void Gather(BibleSyncGather &gather,
+		char message_type,
+		string_view bible  = "",
+		string_view ref    = "",
+		string_view alt    = "",
+		string_view group  = "",
+		string_view domain = "");
+    int SendPackets(BibleSyncPacket *packet, int count);
+    void CountSent(const BibleSyncPacket &packet);
+
+    // what every outbound packet starts with, pre-encoded:
+    // the header, and the identity fields ahead of any content,
+    // as text, compressed and TLV (empty if the values cannot be).
+    // empty prefix means it must be re-made (user or passphrase changed).
+    uint8_t xmit_header[BSP_HEADER_SIZE];
+    string xmit_prefix;
+    string xmit_compressed;
+    string xmit_tlv;
+    bool compress;				// app allows it.
+    bool tlv;					// app allows it.
+    void BuildTransmitPrefix(void);
+    int GatherFields(struct iovec *iov, int count,
+		     const string_view *name, const string_view *value,
+		     int fields);
+    int GatherTLV(BibleSyncGather &gather, int count,
+		  const string_view *tag, const string_view *value,
+		  int fields, size_t room);
+    bool SendGather(struct iovec *iov, int count);
 
     // speaker list management.
-    void ageSpeakers();
+    void ageSpeakers(uint64_t now);
     void clearSpeakers();
 
     // uuid dumper;
-    void uuid_dump(uuid_t &u, char *destination);
-    char uuid_dump_string[BSP_UUID_PRINT_LENGTH];
+    static void uuid_dump(const uuid_t &u, char *destination);
+    bool uuid_scan(string_view key, uuid_t &u);
+    static void uuid_assign(uuid_t &u, const uuid_t *from);
     void uuid_gen(uuid_t &u);		// differentiates linux/win32.
 
 #ifdef linux
     // network self-analysis, borrowed from the net.
-    int get_default_if_name(char *name);
+    static int get_default_if_name(char *name);
 #else
     // no other support routines needed for Windows/Solaris/BSD.
 #endif /* linux */
@@ -393,6 +1136,12 @@ public:
     BibleSync_mode setMode(BibleSync_mode m,
 			   BibleSync_navigate n = NULL,
 			   string p = "");
+    // operation, with events as BibleSync_event rather than
+    // nine strings.  userdata is handed back with each event.
+    BibleSync_mode setModeEvent(BibleSync_mode m,
+				BibleSync_event_func e,
+				void *userdata,
+				string p = "");
     inline BibleSync_mode getMode(void) { return mode; };
 
     // library identification.
@@ -404,49 +1153,231 @@ public:
     // audience receiver
     static int Receive(void *myself); // assume C context: poll from timeout.
 
+    // event-driven receiver: blocks up to timeout_ms (-1: no limit)
+    // until traffic arrives or beacon/aging falls due.
+    static int Receive(void *myself, int timeout_ms);
+
+    // descriptor to watch for readability, for event loop integration.
+    // -1 when there is no network access.  with a receiver thread, it
+    // is readable when the thread has queued events instead.
+    inline int getDescriptor(void)
+    {
+	return (receiver.joinable() ? wake_fd[0] : server_fd);
+    };
+
+    // msec until Receive() must be called even without traffic,
+    // so beacons and speaker aging stay on time.  -1: no such need.
+    int getReceiveTimeout(void);
+
+    // at most this many packets, or msec, of work per Receive(): the
+    // rest waits, and Receive() returns BSP_RECEIVE_MORE.  beacons and
+    // aging still run every call.  0: no limit (default).
+    void setReceiveBudget(unsigned int packets, unsigned int msec);
+
     // speaker transmitter
     // public interface permits only BSP_SYNC transmission.
     // there is no reason for an app to send presence or beacon on its own.
-    inline BibleSync_xmit_status Transmit(string bible  = "KJV",
-					  string ref    = "Gen.1.1",
-					  string alt    = "",
-					  string group  = "1",
-					  string domain = "BIBLE-VERSE")
+    // string_view args take string and const char * alike, uncopied.
+    inline BibleSync_xmit_status Transmit(string_view bible  = "KJV",
+					  string_view ref    = "Gen.1.1",
+					  string_view alt    = "",
+					  string_view group  = "1",
+					  string_view domain = "BIBLE-VERSE")
     {
-	return TransmitInternal(BSP_SYNC, bible, ref, alt, group, domain);
+	return (coalesce_quiet
+		? TransmitCoalesce(bible, ref, alt, group, domain)
+		: TransmitInternal(BSP_SYNC, bible, ref, alt, group, domain));
     }
 
+    // hold navigation briefly, sending only the latest per group
+    // once it has been quiet_ms without change, or max_delay_ms
+    // after first being held.  sent from within Receive().
+    // quiet_ms 0 (the default) sends every Transmit() at once.
+    void setCoalesce(unsigned int quiet_ms, unsigned int max_delay_ms);
+
+    // send any held navigation now.
+    inline void Flush(void) { FlushCoalesced(true); }
+
+    // several navigation and chat messages at once, e.g. one per group.
+    // status[] gets each record's result, as Transmit() would return it.
+    // returns how many were sent.
+    int TransmitBatch(const BibleSync_xmit_record *record,
+		      int count,
+		      BibleSync_xmit_status *status);
+
     // simple chat interface
-    inline BibleSync_xmit_status Chat(string message)
+    inline BibleSync_xmit_status Chat(string_view message)
     {
 	return TransmitInternal(BSP_CHAT, message);
     }
 
+    // send navigation and chat with compressed bodies, when every
+    // peer heard advertises it can decode them.  off by default.
+    inline void setCompression(bool c)
+    {
+	std::lock_guard<std::recursive_mutex> guard(state_lock);
+	compress = c;
+    }
+
+    // send navigation and chat with TLV bodies, likewise; preferred
+    // over compression when both are allowed.  off by default.
+    inline void setTLV(bool t)
+    {
+	std::lock_guard<std::recursive_mutex> guard(state_lock);
+	tlv = t;
+    }
+
     // set privacy using TTL 0 in personal mode.
     bool setPrivate(bool privacy);
 
+    // have the kernel drop malformed packets, and our own echoes,
+    // before they reach us.  linux only; off by default.
+    bool setKernelFilter(bool filter);
+
+    // drop, unparsed, what one sender uuid or one source address sends
+    // beyond rate packets/sec, once burst is spent.  0: no limit.
+    // under a BibleSyncMux, the mux's limits apply instead.
+    void setRateLimit(unsigned int uuid_rate, unsigned int uuid_burst,
+		      unsigned int source_rate, unsigned int source_burst);
+
     // say whether you want to hear from this speaker.
     void listenToSpeaker(bool listen, string speakerkey);
 
-    // Speaker beacon must go out roughly every 10 seconds,
-    // set count to approx divisor. how often does your app call Receive()?
-    // every second, default 10.
-    // every 2 seconds, use 5.
-    // every 3 seconds, use 3 (9 seconds, fine).
-    // value is force-bounded [3..10].
-    inline void setBeaconCount(uint8_t count)
+    // Speaker beacon must go out roughly every 10 seconds.
+    // interval is force-bounded [3000..10000] msec.
+    void setBeaconInterval(unsigned int msec);
+
+    // how long a speaker's beacons may go unheard before it is dead.
+    // bounded [beacon interval..BSP_SPEAKER_TIMEOUT_MAX] msec.
+    void setSpeakerTimeout(unsigned int msec);
+
+    // obsolete: beacons used to be counted in calls of Receive().
+    // they are now timed, however often Receive() is called.
+    inline void setBeaconCount(uint8_t count) { (void)count; }
+
+    // how much packet dumping nav_func wants: off, errors, always.
+    // dump rendering is costly; BSP_DUMP_ERRORS is the default, and
+    // getDump() serves the rest on request.
+    inline void setDumpMode(BibleSync_dump_mode m)
     {
-	if (count > 10) count = 10;
-	if (count < 3)  count = 3;
-	beacon_count = count;
+	if (m < N_BSP_DUMP)
+	    dump_mode = m;
     }
+    inline BibleSync_dump_mode getDumpMode(void) { return dump_mode; };
+
+    // render the current packet's dump on request, from within nav_func.
+    // regardless of dump mode, this is always available during the
+    // callback for a received packet.
+    string getDump(void);
 
     // set new user name
     // useful for apps that can change the name on the fly (e.g. Bishop).
     inline void setUser(string u)
     {
+	std::lock_guard<std::recursive_mutex> guard(state_lock);
 	user = u;
+	xmit_prefix.clear();
     }
+
+    // counters since creation, read without stopping anything.
+    // each is exact, but they are not a consistent set.
+    BibleSync_stats getStats(void);
+    static const char *getStatName(BibleSync_stat s);
+
+    // errors: localized on request, and optionally coalesced.
+    // the locale is noticed here and by setMode().
+    static string_view getErrorText(BibleSync_error error);
+    void setErrorCoalesce(unsigned int interval_ms);
+
+    // run a receiver thread of our own whenever a mode is enabled.
+    // the network is then drained promptly however busy the app is,
+    // and Receive() only delivers events that the thread has queued.
+    // returns whether the thread is running.
+    bool setReceiverThread(bool run);
 };
 
+// one receive socket shared by many BibleSync objects in one process,
+// e.g. a server with an object per classroom.  each packet is read,
+// checked and parsed once, then handed only to the sessions whose
+// passphrase it carries.  sessions keep their own modes, speaker lists
+// and transmit sockets; the multiplexer does all their receiving.
+class BibleSyncMux {
+
+    friend class BibleSync;
+
+private:
+    int server_fd;
+    std::recursive_mutex lock;
+
+    // the interface our membership is on, followed as it changes.
+    struct in_addr interface_addr;
+    uint64_t interface_generation;
+    uint64_t next_interface_check;
+    void FollowInterface(void);
+
+    // sessions, all of them, and the enabled ones by passphrase.
+    std::vector<BibleSync *> members;
+    std::unordered_map<string, std::vector<BibleSync *>> sessions;
+    string lookup;			// reused: no allocation per packet.
+    std::vector<BibleSync *> route;	// reused: callbacks may Rekey().
+    void Rekey(BibleSync *session);
+    void Unkey(BibleSync *session);
+
+    BibleSync::BibleSyncMessage recv_buffer[BSP_RECV_BATCH];
+    struct sockaddr_in recv_source[BSP_RECV_BATCH];
+    int recv_length[BSP_RECV_BATCH];
+    BibleSync::BibleSyncBudget budget;
+    BibleSync::BibleSyncInbound inbound;
+    int ReceiveInternal(bool timed = false, int timeout_ms = 0);
+    void Route(BibleSync::BibleSyncMessage &bsp,
+	       int recv_size,
+	       struct sockaddr_in &source);
+    bool Ours(const BibleSync::BibleSyncMessage &bsp);
+
+    bool kernel_filter;
+
+    // what is refused or unrouted here, as no session ever sees it.
+    std::atomic<uint64_t> stats[N_BSP_STAT];
+    inline void Count(BibleSync_stat s, uint64_t n = 1)
+    {
+	stats[s].fetch_add(n, std::memory_order_relaxed);
+    }
+
+public:
+    BibleSyncMux();
+    ~BibleSyncMux();
+
+    // take over a session's receiving, opening our socket if need be.
+    // returns "" on success, else what failed, as 'E' would say.
+    string Add(BibleSync *session);
+
+    // give a session back its own receiving, if its mode is enabled.
+    void Remove(BibleSync *session);
+
+    // as BibleSync::Receive(), for all sessions at once.  callbacks
+    // happen within, each as its own session would make them.
+    static int Receive(void *myself);
+    static int Receive(void *myself, int timeout_ms);
+    inline int getDescriptor(void) { return server_fd; };
+    int getReceiveTimeout(void);
+    void setReceiveBudget(unsigned int packets, unsigned int msec);
+
+    // as BibleSync::setKernelFilter(), but for malformed packets only:
+    // many sessions' echoes come here.
+    bool setKernelFilter(bool filter);
+
+    // as BibleSync::setRateLimit(), for every session's traffic.
+    void setRateLimit(unsigned int uuid_rate, unsigned int uuid_burst,
+		      unsigned int source_rate, unsigned int source_burst);
+
+    // packets received, refused, and not for any session.
+    BibleSync_stats getStats(void);
+};
+
+// a multiplexer's sessions hear the network through it.
+inline BibleSync::BibleSyncPeers &BibleSync::Peers(void)
+{
+    return ((mux != NULL) ? mux->inbound.peers : inbound.peers);
+}
+
 #endif // __BIBLESYNC_HH__
@@ -0,0 +1,394 @@
+/*
+ * BibleSync library
+ * biblesync-mux.cc
+ *
+ * All files related to implementation of BibleSync, including program
+ * source, READMEs, manual pages, and related similar documents, are in
+ * the public domain.  As a matter of simple decency, your social
+ * obligations are to credit the source and to coordinate any changes you
+ * make back to the origin repository.  These obligations are non-
+ * binding for public domain software, but they are to be seriously
+ * handled nonetheless.
+ */
+
+//
+// BibleSyncMux - many sessions, one receive socket.
+//
+// every BibleSync object has its own socket bound to BSP_PORT, so each
+// datagram is copied to, and parsed by, each of them.  a server running
+// dozens of sessions wants one socket instead: read, check and parse
+// once, then look up the passphrase and hand the packet to its session.
+//
+
+#include <biblesync.hh>
+#include <errno.h>
+#ifndef WIN32
+#include <poll.h>
+#endif
+
+using namespace std;
+
+#define	BSP		(string)"BibleSync: "
+#define	EMPTY		(string)""
+
+BibleSyncMux::BibleSyncMux()
+    : server_fd(-1),
+      interface_generation(0),
+      next_interface_check(0),
+      kernel_filter(false)
+{
+    interface_addr.s_addr = htonl(0x7f000001);	// 127.0.0.1
+    for (int i = 0; i < N_BSP_STAT; ++i)
+	stats[i].store(0, std::memory_order_relaxed);
+}
+
+// sessions go back to receiving on their own.
+BibleSyncMux::~BibleSyncMux()
+{
+    std::lock_guard<std::recursive_mutex> guard(lock);
+
+    while (!members.empty())
+	Remove(members.back());
+    close(server_fd);
+    server_fd = -1;
+}
+
+// take over a session's receiving.
+string BibleSyncMux::Add(BibleSync *session)
+{
+    std::lock_guard<std::recursive_mutex> guard(lock);
+    string retval = "";
+
+    if (session->mux == this)
+	return retval;
+    if (session->mux != NULL)
+	session->mux->Remove(session);
+
+    // join the group where sessions send.
+    if (server_fd < 0)
+    {
+	interface_addr = BibleSync::CachedInterface(interface_generation);
+	server_fd = BibleSync::OpenListener(interface_addr, retval);
+	if (server_fd < 0)
+	    return retval;
+	if (kernel_filter)
+	    (void)BibleSync::AttachFilter(server_fd, true, NULL);
+    }
+
+    // the session's own receiving stops for good.
+    session->StopReceiver();
+    {
+	std::lock_guard<std::recursive_mutex> session_guard(session->state_lock);
+	session->Count(BSP_STAT_KERNEL_DROPPED,
+		       BibleSync::KernelDrops(session->server_fd));
+	close(session->server_fd);
+	session->server_fd = -1;
+	session->budget.held = session->budget.next = 0;
+	session->mux = this;
+    }
+
+    members.push_back(session);
+    Rekey(session);
+    return retval;
+}
+
+// give a session back its own receiving.
+void BibleSyncMux::Remove(BibleSync *session)
+{
+    std::lock_guard<std::recursive_mutex> guard(lock);
+
+    if (session->mux != this)
+	return;
+
+    Unkey(session);
+    for (size_t i = 0; i < members.size(); ++i)
+    {
+	if (members[i] == session)
+	{
+	    members.erase(members.begin() + i);
+	    break;
+	}
+    }
+
+    std::lock_guard<std::recursive_mutex> session_guard(session->state_lock);
+    session->mux = NULL;
+    if (session->mode != BSP_MODE_DISABLE)
+    {
+	string result = "";
+	session->server_fd = BibleSync::OpenListener(session->interface_addr,
+						     result);
+	if (session->server_fd < 0)
+	    session->ReportError(BSP_ERROR_NETWORK_SETUP, EMPTY, NULL, NULL,
+				 EMPTY, EMPTY, EMPTY, EMPTY, EMPTY, EMPTY,
+				 result);
+	else
+	{
+	    if (session->kernel_filter)
+		(void)BibleSync::AttachFilter(session->server_fd, true,
+					      &session->uuid);
+	    if (session->receiver_wanted)
+		session->StartReceiver();
+	}
+    }
+}
+
+// file a session under its current passphrase, if enabled.
+// called on Add() and after every setMode().
+void BibleSyncMux::Rekey(BibleSync *session)
+{
+    std::lock_guard<std::recursive_mutex> guard(lock);
+
+    Unkey(session);
+    if ((session->mux == this) && (session->mode != BSP_MODE_DISABLE))
+	sessions[session->passphrase].push_back(session);
+}
+
+void BibleSyncMux::Unkey(BibleSync *session)
+{
+    for (auto it = sessions.begin(); it != sessions.end(); )
+    {
+	std::vector<BibleSync *> &list = it->second;
+
+	for (size_t i = 0; i < list.size(); ++i)
+	{
+	    if (list[i] == session)
+	    {
+		list.erase(list.begin() + i);
+		break;
+	    }
+	}
+	if (list.empty())
+	    it = sessions.erase(it);
+	else
+	    ++it;
+    }
+}
+
+// receivers, as for BibleSync.
+int BibleSyncMux::Receive(void *myself)
+{
+    return ((BibleSyncMux *)myself)->ReceiveInternal();
+}
+
+int BibleSyncMux::Receive(void *myself, int timeout_ms)
+{
+    return ((BibleSyncMux *)myself)->ReceiveInternal(true, timeout_ms);
+}
+
+// FALSE only while there is no socket, i.e. before the first Add().
+int BibleSyncMux::ReceiveInternal(bool timed, int timeout_ms)
+{
+    if (server_fd < 0)
+	return FALSE;
+
+    // event-driven use: sleep until there is something to do.
+    if (timed)
+    {
+	int due = getReceiveTimeout();
+
+	if ((timeout_ms < 0) || ((due >= 0) && (due < timeout_ms)))
+	    timeout_ms = due;
+#ifndef WIN32
+	struct pollfd pfd;
+	pfd.fd = server_fd;
+	pfd.events = POLLIN;
+	pfd.revents = 0;
+	(void)poll(&pfd, 1, timeout_ms);
+#else
+	fd_set read_set;
+	struct timeval tv = { timeout_ms / 1000, (timeout_ms % 1000) * 1000 };
+	FD_ZERO(&read_set);
+	FD_SET(server_fd, &read_set);
+	(void)select(server_fd+1, &read_set, NULL, NULL,
+		     ((timeout_ms < 0) ? NULL : &tv));
+#endif /* WIN32 */
+    }
+
+    std::lock_guard<std::recursive_mutex> guard(lock);
+    const char *failure;
+    bool more = false;
+
+    // as much as the budget allows, as for BibleSync.
+    // a read error belongs to no session: stop and try again next time.
+    BibleSync::BudgetStart(budget);
+    for (;;)
+    {
+	if (BibleSync::BudgetSpent(budget))
+	{
+	    more = ((budget.next < budget.held) ||
+		    BibleSync::Readable(server_fd));
+	    break;
+	}
+
+	if (budget.next >= budget.held)
+	{
+	    budget.next = 0;
+	    budget.held = max(BibleSync::ReadBatch(server_fd, recv_buffer,
+						   recv_source, recv_length,
+						   failure,
+						   BibleSync::BudgetBatch(budget)),
+			      0);
+	    if (budget.held == 0)
+		break;
+	}
+
+	int i = budget.next++;
+	++budget.handled;
+	Route(recv_buffer[i], recv_length[i], recv_source[i]);
+    }
+
+    // our membership follows the network; sessions' sending, below.
+    FollowInterface();
+
+    // every session's held navigation, beacons and aging.
+    for (size_t i = 0; i < members.size(); ++i)
+    {
+	BibleSync *session = members[i];
+	std::lock_guard<std::recursive_mutex> session_guard(session->state_lock);
+
+	if (session->mode != BSP_MODE_DISABLE)
+	    session->ReceiveDone();
+    }
+    return (more ? BSP_RECEIVE_MORE : TRUE);
+}
+
+// check and parse once; deliver to each session holding the passphrase.
+void BibleSyncMux::Route(BibleSync::BibleSyncMessage &bsp,
+			 int recv_size,
+			 struct sockaddr_in &source)
+{
+    BibleSync::BibleSyncReceived message;
+
+    Count(BSP_STAT_RECV_BYTES, recv_size);
+    if ((recv_size >= BSP_HEADER_SIZE) &&
+	(bsp.msg_type >= BSP_ANNOUNCE) && (bsp.msg_type <= BSP_CHAT))
+	Count((BibleSync_stat)(BSP_STAT_RECV_ANNOUNCE +
+			       bsp.msg_type - BSP_ANNOUNCE));
+
+    // fragments are made whole here, once, whoever they are for.
+    BibleSync_stat reject = BibleSync::CheckPacket(bsp, recv_size, source,
+						   Ours(bsp), inbound, stats,
+						   message);
+    if (reject != N_BSP_STAT)
+    {
+	if (reject != BSP_STAT_FRAGMENTS)
+	    Count(reject);
+	return;
+    }
+
+    lookup.assign(message.fields.value[BSP_FIELD_MSG_PASSPHRASE]);
+    auto found = sessions.find(lookup);
+    if (found == sessions.end())
+    {
+	Count(BSP_STAT_UNROUTED);
+	return;
+    }
+
+    // a callback may change its session's mode, and so our map.
+    route.assign(found->second.begin(), found->second.end());
+    for (BibleSync *session : route)
+    {
+	std::lock_guard<std::recursive_mutex> session_guard(session->state_lock);
+
+	if ((session->mux != this) ||
+	    (session->mode == BSP_MODE_DISABLE) ||
+	    !session->HasCallback())
+	    continue;
+
+	session->ArenaReset();
+	session->dump_packet = message.header;
+	session->dump_body = message.body;
+	session->dump_source = &source;
+	session->dump_size = BSP_HEADER_SIZE + message.length;
+	session->CountReceived(*message.header, session->dump_size);
+	session->AcceptPacket(*message.header, message.fields, source);
+    }
+}
+
+// whether a packet is one of our members' own, looped back to us.
+// only rate limiting cares, so the members go unsearched without it.
+bool BibleSyncMux::Ours(const BibleSync::BibleSyncMessage &bsp)
+{
+    if ((inbound.by_uuid.rate == 0) && (inbound.by_source.rate == 0))
+	return false;
+    for (BibleSync *session : members)
+    {
+	if (memcmp((const void *)&bsp.uuid, (const void *)&session->uuid,
+		   sizeof(uuid_t)) == 0)
+	    return true;
+    }
+    return false;
+}
+
+// as BibleSync::FollowInterface(), for the one socket we have.
+void BibleSyncMux::FollowInterface(void)
+{
+    if ((server_fd < 0) ||
+	!BibleSync::InterfaceDue(next_interface_check) ||
+	!BibleSync::InterfaceChanged(interface_generation))
+	return;
+
+    // failure leaves us in no group; the next change tries again.
+    struct in_addr from = interface_addr;
+    interface_addr = BibleSync::CachedInterface(interface_generation);
+    if (interface_addr.s_addr != from.s_addr)
+	(void)BibleSync::Rejoin(server_fd, from, interface_addr);
+}
+
+// soonest of any session's housekeeping.
+int BibleSyncMux::getReceiveTimeout(void)
+{
+    std::lock_guard<std::recursive_mutex> guard(lock);
+    int soonest = -1;
+
+    if (budget.next < budget.held)
+	return 0;			// left by the last budget.
+
+    for (BibleSync *session : members)
+    {
+	int due = session->getReceiveTimeout();
+
+	if ((due >= 0) && ((soonest < 0) || (due < soonest)))
+	    soonest = due;
+    }
+    return soonest;
+}
+
+void BibleSyncMux::setReceiveBudget(unsigned int packets, unsigned int msec)
+{
+    std::lock_guard<std::recursive_mutex> guard(lock);
+
+    budget.packets = packets;
+    budget.msec = msec;
+}
+
+// malformed packets only: our sessions' echoes are told apart later.
+bool BibleSyncMux::setKernelFilter(bool filter)
+{
+    std::lock_guard<std::recursive_mutex> guard(lock);
+
+    kernel_filter = filter;
+    return BibleSync::AttachFilter(server_fd, filter, NULL);
+}
+
+void BibleSyncMux::setRateLimit(unsigned int uuid_rate,
+				unsigned int uuid_burst,
+				unsigned int source_rate,
+				unsigned int source_burst)
+{
+    std::lock_guard<std::recursive_mutex> guard(lock);
+
+    BibleSync::SetLimit(inbound.by_uuid, uuid_rate, uuid_burst);
+    BibleSync::SetLimit(inbound.by_source, source_rate, source_burst);
+}
+
+BibleSync_stats BibleSyncMux::getStats(void)
+{
+    BibleSync_stats snapshot;
+
+    for (int i = 0; i < N_BSP_STAT; ++i)
+	snapshot.value[i] = stats[i].load(std::memory_order_relaxed);
+    std::lock_guard<std::recursive_mutex> guard(lock);
+    snapshot.value[BSP_STAT_KERNEL_DROPPED] += BibleSync::KernelDrops(server_fd);
+    return snapshot;
+}
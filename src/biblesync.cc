@@ -18,79 +18,221 @@
 //
 
 #include <biblesync.hh>
+#include <errno.h>
+#include <locale.h>
+#include <memory>
+#ifndef WIN32
+#include <fcntl.h>
+#include <poll.h>
+#endif
 
 using namespace std;
 
-// chat is a proper superset of announce/beacon,
-// sync is a proper superset of chat,
-// both inbound as well as outbound.
-// in these 2 arrays of strings, chat-specific fields follow
-// announce fields, and sync-specific follow chat fields.
-// (chat overloads bible for this purpose.)
-// see field_count in ReceiveInternal + TransmitInternal.
-static string inbound_required[] = {
-    BSP_APP_NAME,
-    BSP_APP_INSTANCE_UUID,
-    BSP_APP_USER,
-    BSP_MSG_PASSPHRASE,
-    BSP_MSG_SYNC_BIBLEABBREV,
-    BSP_MSG_SYNC_DOMAIN,
-    BSP_MSG_SYNC_VERSE,
-    BSP_MSG_SYNC_GROUP
+// known inbound field names, indexed by BSP_FIELD_*.
+// inbound bodies are located in place, never copied: each known name
+// maps to its slot by a perfect hash, verified at compile time below.
+// names not known to us are skipped.
+typedef struct _BibleSyncFieldName {
+    const char *name;
+    size_t      length;
+} BibleSyncFieldName;
+
+#define	FIELD_NAME(n)	{ n, sizeof(n) - 1 }
+
+static constexpr BibleSyncFieldName field_names[] = {
+    FIELD_NAME(BSP_APP_NAME),
+    FIELD_NAME(BSP_APP_VERSION),
+    FIELD_NAME(BSP_APP_INSTANCE_UUID),
+    FIELD_NAME(BSP_APP_OS),
+    FIELD_NAME(BSP_APP_DEVICE),
+    FIELD_NAME(BSP_APP_USER),
+    FIELD_NAME(BSP_MSG_SYNC_DOMAIN),
+    FIELD_NAME(BSP_MSG_SYNC_VERSE),
+    FIELD_NAME(BSP_MSG_SYNC_ALTVERSE),
+    FIELD_NAME(BSP_MSG_SYNC_BIBLEABBREV),
+    FIELD_NAME(BSP_MSG_SYNC_GROUP),
+    FIELD_NAME(BSP_MSG_PASSPHRASE),
+    FIELD_NAME(BSP_MSG_CHAT)
 };
-#define	CHAT_INBOUND_INDEX	4	// index in list above.
+static_assert(sizeof(field_names) / sizeof(field_names[0]) == N_BSP_FIELD,
+	      "field_names[] out of step with BSP_FIELD_*");
+
+// length and last character suffice to tell known names apart.
+#define	FIELD_HASH_SIZE	32
+
+static constexpr unsigned field_hash(const char *name, size_t length)
+{
+    return ((length << 2) + (unsigned char)name[length - 1])
+	& (FIELD_HASH_SIZE - 1);
+}
+
+typedef struct _BibleSyncFieldHash {
+    int8_t slot[FIELD_HASH_SIZE];	// BSP_FIELD_*, or -1.
+    bool   perfect;			// no two names collide.
+} BibleSyncFieldHash;
+
+static constexpr BibleSyncFieldHash field_hash_build()
+{
+    BibleSyncFieldHash h = { {}, true };
+
+    for (int i = 0; i < FIELD_HASH_SIZE; ++i)
+	h.slot[i] = -1;
+    for (int i = 0; i < N_BSP_FIELD; ++i)
+    {
+	unsigned bucket = field_hash(field_names[i].name,
+				     field_names[i].length);
+	if (h.slot[bucket] != -1)
+	    h.perfect = false;
+	h.slot[bucket] = i;
+    }
+    return h;
+}
+
+static constexpr BibleSyncFieldHash field_lookup = field_hash_build();
+static_assert(field_lookup.perfect,
+	      "field_hash() collides on known field names; choose another");
+
+// which slot a name belongs in, or -1 if unknown.
+static inline int field_index(const char *name, size_t length)
+{
+    if (length == 0)
+	return -1;
+    int i = field_lookup.slot[field_hash(name, length)];
+    return (((i >= 0) &&
+	     (field_names[i].length == length) &&
+	     (memcmp(field_names[i].name, name, length) == 0))
+	    ? i
+	    : -1);
+}
 
-static int inbound_required_count[5] =
+// chat is a proper superset of announce/beacon,
+// sync is a proper superset of announce, too.
+// required inbound fields, as bitmasks by message type.
+#define	FIELDS_RECV_ANNOUNCE	(BSP_FIELD_BIT(BSP_FIELD_APP_NAME)		| \
+				 BSP_FIELD_BIT(BSP_FIELD_APP_INSTANCE_UUID)	| \
+				 BSP_FIELD_BIT(BSP_FIELD_APP_USER)		| \
+				 BSP_FIELD_BIT(BSP_FIELD_MSG_PASSPHRASE))
+#define	FIELDS_RECV_CHAT	(FIELDS_RECV_ANNOUNCE				| \
+				 BSP_FIELD_BIT(BSP_FIELD_MSG_CHAT))
+#define	FIELDS_RECV_SYNC	(FIELDS_RECV_ANNOUNCE				| \
+				 BSP_FIELD_BIT(BSP_FIELD_MSG_SYNC_BIBLEABBREV)	| \
+				 BSP_FIELD_BIT(BSP_FIELD_MSG_SYNC_DOMAIN)	| \
+				 BSP_FIELD_BIT(BSP_FIELD_MSG_SYNC_VERSE)	| \
+				 BSP_FIELD_BIT(BSP_FIELD_MSG_SYNC_GROUP))
+
+static uint32_t inbound_required[5] =
 {
 	0,				// unused
-	BSP_FIELDS_RECV_ANNOUNCE,
-	BSP_FIELDS_RECV_SYNC,
-	BSP_FIELDS_RECV_ANNOUNCE,	// beacon identical to announce
-	BSP_FIELDS_RECV_CHAT
+	FIELDS_RECV_ANNOUNCE,
+	FIELDS_RECV_SYNC,
+	FIELDS_RECV_ANNOUNCE,		// beacon identical to announce
+	FIELDS_RECV_CHAT
 };
 
-static string outbound_fill[] = {
-    BSP_APP_NAME,
-    BSP_APP_VERSION,
-    BSP_APP_INSTANCE_UUID,
-    BSP_APP_OS,
-    BSP_APP_DEVICE,
-    BSP_APP_USER,
-    BSP_MSG_PASSPHRASE,
-    BSP_MSG_SYNC_BIBLEABBREV,
-    BSP_MSG_SYNC_DOMAIN,
-    BSP_MSG_SYNC_GROUP,
-    BSP_MSG_SYNC_ALTVERSE,
-    BSP_MSG_SYNC_VERSE		// last: could go overly long, risk cutoff.
+// outbound: identity fields lead every message, pre-encoded once
+// in xmit_prefix, in this order: app.name, app.version, app.inst.uuid,
+// app.os, app.device, app.user, msg.sync.passPhrase.
+// chat then adds its message; sync adds these, in this order.
+// ("name=" only: values are gathered straight from the caller.)
+static constexpr string_view outbound_sync[] = {
+    BSP_MSG_SYNC_BIBLEABBREV "=",
+    BSP_MSG_SYNC_DOMAIN "=",
+    BSP_MSG_SYNC_GROUP "=",
+    BSP_MSG_SYNC_ALTVERSE "=",
+    BSP_MSG_SYNC_VERSE "="	// last: could go overly long, risk cutoff.
 };
-#define	CHAT_OUTBOUND_INDEX	7	// index in list above.
+static_assert(sizeof(outbound_sync) / sizeof(outbound_sync[0]) ==
+	      BSP_FIELDS_XMIT_SYNC - BSP_FIELDS_XMIT_ANNOUNCE,
+	      "outbound_sync[] out of step with BSP_FIELDS_XMIT_SYNC");
+static constexpr string_view outbound_chat = BSP_MSG_CHAT "=";
+
+// compressed equivalents: one token byte per name, and common values.
+#define	TOKEN(f)	((char)(BSP_TOKEN_NAME + (f)))
+static constexpr char name_tokens[N_BSP_FIELD] = {
+    TOKEN(0), TOKEN(1), TOKEN(2),  TOKEN(3),  TOKEN(4),  TOKEN(5), TOKEN(6),
+    TOKEN(7), TOKEN(8), TOKEN(9), TOKEN(10), TOKEN(11), TOKEN(12)
+};
+static_assert(N_BSP_FIELD == 13, "name_tokens[] out of step with BSP_FIELD_*");
+#define	NAME_TOKEN(f)	string_view(&name_tokens[f], 1)
+
+static constexpr string_view compressed_sync[] = {
+    NAME_TOKEN(BSP_FIELD_MSG_SYNC_BIBLEABBREV),
+    NAME_TOKEN(BSP_FIELD_MSG_SYNC_DOMAIN),
+    NAME_TOKEN(BSP_FIELD_MSG_SYNC_GROUP),
+    NAME_TOKEN(BSP_FIELD_MSG_SYNC_ALTVERSE),
+    NAME_TOKEN(BSP_FIELD_MSG_SYNC_VERSE)
+};
+static constexpr string_view compressed_chat = NAME_TOKEN(BSP_FIELD_MSG_CHAT);
 
-static int outbound_fill_count[5] =
-{
-	0,				// unused
-	BSP_FIELDS_XMIT_ANNOUNCE,
-	BSP_FIELDS_XMIT_SYNC,
-	BSP_FIELDS_XMIT_ANNOUNCE,	// beacon identical to announce
-	BSP_FIELDS_XMIT_CHAT
+static constexpr string_view value_table[BSP_TOKEN_VALUES] = {
+    "BIBLE-VERSE", "Linux", "Windows", "UNIX"
 };
+static constexpr char value_tokens[BSP_TOKEN_VALUES] = { 1, 2, 3, 4 };
 
-static string chat_field = BSP_MSG_CHAT;	// for referential substitution.
+// a value as sent compressed: its token, if it has one.
+// false if it cannot be sent compressed, looking like a token itself.
+static bool compress_value(string_view &value)
+{
+    for (int i = 0; i < BSP_TOKEN_VALUES; ++i)
+    {
+	if (value == value_table[i])
+	{
+	    value = string_view(&value_tokens[i], 1);
+	    return true;
+	}
+    }
+    return !((value.length() == 1) &&
+	     (value[0] >= 1) && (value[0] <= BSP_TOKEN_VALUES));
+}
+static char outbound_newline[] = "\n";
 
 // BibleSync class constructor.
 // args identify the user of the class, by application, version, and user.
 BibleSync::BibleSync(string a, string v, string u)
-    : BibleSync_version(BIBLESYNC_VERSION_STR),
+    : speaker_count(0),
+      BibleSync_version(BIBLESYNC_VERSION_STR),
       application(a),
       version(v),
       user(u),
       receiving(false),
-      beacon_countdown(0),
-      beacon_count(BSP_BEACON_COUNT),
+      beacon_msec(BSP_BEACON_MSEC),
+      speaker_timeout(BSP_BEACON_MSEC * BSP_BEACON_MULTIPLIER),
+      next_beacon(0),
+      next_tick(0),
+      wheel_now(0),
+      speaker_serial(0),
+      coalesce_quiet(0),
+      coalesce_max(0),
+      error_interval(0),
+      error_at_hand(BSP_ERROR_NONE),
+      error_repeats(0),
       mode(BSP_MODE_DISABLE),
       nav_func(NULL),
+      event_func(NULL),
+      event_data(NULL),
       passphrase("BibleSync"),
       server_fd(-1),
-      client_fd(-1)
+      client_fd(-1),
+      kernel_filter(false),
+      mux(NULL),
+      arena(arena_buffer, sizeof(arena_buffer)),
+      receiver_wanted(false),
+      receiver_stop(false),
+      shutdown_pending(false),
+      queue_head(0),
+      queue_tail(0),
+      queue_lost(0),
+      dispatching(false),
+      dispatch_dump(NULL),
+      wake_armed(false),
+      dump_mode(BSP_DUMP_ERRORS),
+      dump_packet(NULL),
+      dump_body(NULL),
+      dump_source(NULL),
+      dump_size(0),
+      fragment_id(0),
+      compress(false),
+      tlv(false)
 {
 #ifndef WIN32
     // cobble together a description of this machine.
@@ -106,14 +248,153 @@ BibleSync::BibleSync(string a, string v, string u)
 #endif
 
     interface_addr.s_addr = htonl(0x7f000001);	// 127.0.0.1
+    interface_generation = 0;
+    next_interface_check = 0;
+    recovering = false;
 
     // identify ourselves uniquely.
     uuid_gen(uuid);
     uuid_dump(uuid, uuid_string);
+
+    for (int i = 0; i < N_BSP_STAT; ++i)
+	stats[i].store(0, std::memory_order_relaxed);
+    memset(errors_seen, 0, sizeof(errors_seen));
+    wake_fd[0] = wake_fd[1] = -1;
+    error_source[0] = '\0';
+}
+
+// value of one hex digit, or -1.
+static inline int hex_value(char c)
+{
+    if ((c >= '0') && (c <= '9'))
+	return c - '0';
+    if ((c >= 'a') && (c <= 'f'))
+	return c - 'a' + 10;
+    if ((c >= 'A') && (c <= 'F'))
+	return c - 'A' + 10;
+    return -1;
+}
+
+// monotonic time in msec, immune to wall clock changes.
+static uint64_t now_msec(void)
+{
+#ifndef WIN32
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ((uint64_t)ts.tv_sec * 1000) + (ts.tv_nsec / 1000000);
+#else
+    return GetTickCount64();
+#endif /* WIN32 */
 }
 
 #define	BSP		(string)"BibleSync: "
 #define	EMPTY		(string)""
+static constexpr string_view bsp_text = "BibleSync: ";
+
+#ifndef LC_MESSAGES
+#define	LC_MESSAGES	LC_ALL
+#endif
+
+// marks a msgid for xgettext (-kN_), to be translated later.
+#ifndef N_
+#define	N_(x)	x
+#endif
+
+// text the packet path needs, translated once per locale rather than
+// once per packet.  errors first, indexed by BibleSync_error.
+// msgids are as shipped, so that existing translations still apply;
+// errors' trailing separators are dropped once translated.
+#define	TEXT_PRESENT_AT		(N_BSP_ERROR + 0)
+#define	TEXT_USING		(N_BSP_ERROR + 1)
+#define	TEXT_MORE_FROM		(N_BSP_ERROR + 2)
+#define	TEXT_MORE		(N_BSP_ERROR + 3)
+#define	N_TEXT			(N_BSP_ERROR + 4)
+
+static const char *text_msgids[N_TEXT] = {
+    "",
+    N_("network setup errors."),
+    N_("network change errors."),
+    N_("receive failed"),
+    N_("Transmit failed.\n"),
+    N_("event queue overflow, events lost"),
+    N_("packet too short"),
+    N_("bad magic"),
+    N_("bad protocol version"),
+    N_("bad msg type"),
+    N_("bad packet count"),
+    N_("bad packet index"),
+    N_("bad body format"),
+    N_("missing required header "),
+    N_("Domain not 'BIBLE-VERSE': "),
+    N_("Invalid group: "),
+    N_(" present at "),
+    N_(" using "),
+    N_("(%u more from %.*s)"),
+    N_("(%u more)")
+};
+
+// one locale's translations, never changed once published.  tables
+// are kept, as a reader may still hold any of them; there are only
+// ever as many as locales used.
+typedef struct _TextTable {
+    string      locale;
+    string_view text[N_TEXT];
+} TextTable;
+
+static std::mutex text_lock;
+static std::vector<std::unique_ptr<TextTable>> text_tables;
+static std::atomic<const TextTable *> text_table(NULL);
+
+// notice a change of locale: from setMode() and getErrorText() only,
+// so that the packet path never asks.
+static void text_refresh(void)
+{
+    const char *locale = setlocale(LC_MESSAGES, NULL);
+    std::lock_guard<std::mutex> guard(text_lock);
+
+    if (locale == NULL)
+	locale = "";
+    const TextTable *current = text_table.load(std::memory_order_relaxed);
+    if ((current != NULL) && (current->locale == locale))
+	return;
+    for (std::unique_ptr<TextTable> &t : text_tables)
+    {
+	if (t->locale == locale)
+	{
+	    text_table.store(t.get(), std::memory_order_release);
+	    return;
+	}
+    }
+
+    std::unique_ptr<TextTable> table(new TextTable);
+    table->locale = locale;
+    for (int i = 0; i < N_TEXT; ++i)
+    {
+	string_view text = ((*text_msgids[i] != '\0')
+			    ? _(text_msgids[i]) : "");
+	// an error's text is followed by its own separator, if any.
+	if (i < N_BSP_ERROR)
+	    while (!text.empty() &&
+		   (strchr(" :\n", text.back()) != NULL))
+		text.remove_suffix(1);
+	table->text[i] = text;
+    }
+    text_table.store(table.get(), std::memory_order_release);
+    text_tables.push_back(std::move(table));
+}
+
+// lock-free: the table last published.
+static string_view translated(int which)
+{
+    const TextTable *table = text_table.load(std::memory_order_acquire);
+
+    if (table == NULL)
+    {
+	text_refresh();
+	table = text_table.load(std::memory_order_acquire);
+    }
+    return table->text[which];
+}
 
 // BibleSync class destructor.
 // kill it all off.
@@ -121,6 +402,15 @@ BibleSync::~BibleSync()
 {
     if ((client_fd >= 0) || (server_fd >= 0))
 	Shutdown();
+    if (mux != NULL)
+	mux->Remove(this);
+#ifndef WIN32
+    if (wake_fd[0] >= 0)
+    {
+	close(wake_fd[0]);
+	close(wake_fd[1]);
+    }
+#endif
 }
 
 // mode choice and setup invocation.
@@ -128,16 +418,43 @@ BibleSync_mode BibleSync::setMode(BibleSync_mode m,
 				  BibleSync_navigate n,
 				  string p)
 {
+    return SetModeInternal(m, n, NULL, NULL, p);
+}
+
+// mode choice, with events delivered as BibleSync_event.
+BibleSync_mode BibleSync::setModeEvent(BibleSync_mode m,
+				       BibleSync_event_func e,
+				       void *userdata,
+				       string p)
+{
+    return SetModeInternal(m, NULL, e, userdata, p);
+}
+
+BibleSync_mode BibleSync::SetModeInternal(BibleSync_mode m,
+					  BibleSync_navigate n,
+					  BibleSync_event_func e,
+					  void *userdata,
+					  string p)
+{
+    // the receiver thread must not run while the network is re-made.
+    StopReceiver();
+
+    // translations follow the locale as of the latest mode change.
+    text_refresh();
+
     if ((mode == BSP_MODE_DISABLE) ||
 	((mode != BSP_MODE_DISABLE) &&
-	 (n != NULL)))		// oops.
+	 ((n != NULL) || (e != NULL))))	// oops.
     {
 	mode = m;
 	if (p != "")
 	{
 	    passphrase = p;			// use existing.
 	}
+	xmit_prefix.clear();
 	nav_func = n;
+	event_func = e;
+	event_data = userdata;
 	if (mode == BSP_MODE_DISABLE)
 	    Shutdown();
     }
@@ -149,13 +466,18 @@ BibleSync_mode BibleSync::setMode(BibleSync_mode m,
     string result = Setup();
     if (result != "")
     {
-	if (nav_func != NULL)
-	    (*nav_func)('E', EMPTY,
-			EMPTY, EMPTY, EMPTY, EMPTY, EMPTY,
-			BSP + _("network setup errors."), result);
+	ReportError(BSP_ERROR_NETWORK_SETUP, EMPTY, NULL, NULL,
+		    EMPTY, EMPTY, EMPTY, EMPTY, EMPTY, EMPTY, result);
 	Shutdown();
     }
 
+    if (receiver_wanted && (mode != BSP_MODE_DISABLE))
+	StartReceiver();
+
+    // our multiplexer routes by passphrase, which may have changed.
+    if (mux != NULL)
+	mux->Rekey(this);
+
     return mode;
 }
 
@@ -230,48 +552,13 @@ string BibleSync::Setup()
 	}
 
 	// audience == "server" insofar as he recvs nav from speaker.
-	if (ok_so_far && (server_fd < 0))
+	// a multiplexer's sessions share its socket instead.
+	if (ok_so_far && (server_fd < 0) && (mux == NULL))
 	{
-	    if ((server_fd = socket(AF_INET, SOCK_DGRAM, IPPROTO_UDP)) < 0)
-	    {
-		ok_so_far = false;
-		retval += _(" server socket");
-	    }
-	    else
-	    {
-		int reuse = 1;
-		if (setsockopt(server_fd, SOL_SOCKET, SO_REUSEADDR,
-			       (char *)&reuse, sizeof(reuse)) < 0)
-		{
-		    ok_so_far = false;
-		    retval += " SO_REUSEADDR";
-		}
-
-		memset((char *) &server, 0, sizeof(server));
-		server.sin_family = AF_INET;
-		server.sin_port = htons(BSP_PORT);
-		server.sin_addr.s_addr = INADDR_ANY;
-
-		// make it receive-ready.
-		if (bind(server_fd, (struct sockaddr*)&server,
-			 sizeof(server)) == -1)
-		{
-		    ok_so_far = false;
-		    retval += " bind";
-		}
-
-		// multicast join.
-		multicast_req.imr_multiaddr.s_addr = inet_addr(BSP_MULTICAST);
-		multicast_req.imr_interface.s_addr = interface_addr.s_addr;
-		if (setsockopt(server_fd, IPPROTO_IP, IP_ADD_MEMBERSHIP,
-			       (char *)&multicast_req, sizeof(multicast_req))
-		    < 0)
-		{
-		    ok_so_far = false;
-		    retval += " IP_ADD_MEMBERSHIP";
-		}
-		// bind(2) leaves us ready for recvfrom(2) calls.
-	    }
+	    server_fd = OpenListener(interface_addr, retval);
+	    ok_so_far = (server_fd >= 0);
+	    if (ok_so_far && kernel_filter)
+		(void)AttachFilter(server_fd, true, &uuid);
 	}
 
 	// if we are either kind of speaker, we must broadcast our first
@@ -281,7 +568,7 @@ string BibleSync::Setup()
 	if ((mode == BSP_MODE_PERSONAL) || (mode == BSP_MODE_SPEAKER))
 	{
 	    TransmitInternal(BSP_BEACON);
-	    beacon_countdown = beacon_count;
+	    next_beacon = now_msec() + beacon_msec;
 
 	    // speaker mode => speaker list has become irrelevant.
 	    if (mode == BSP_MODE_SPEAKER)
@@ -291,8 +578,9 @@ string BibleSync::Setup()
 	}
 	else	// audience only.
 	{
-	    beacon_countdown = 0;
+	    next_beacon = 0;
 	}
+	Reschedule();
 
 	// now that we're alive, tell the network world that we're here.
 	if (retval == "")
@@ -302,13 +590,182 @@ string BibleSync::Setup()
     return retval;
 }
 
+// receive socket: bound to BSP_PORT, joined to BSP_MULTICAST.
+// returns the descriptor, or -1 with what failed added to errors.
+int BibleSync::OpenListener(struct in_addr interface, string &errors)
+{
+    int fd;
+
+    if ((fd = socket(AF_INET, SOCK_DGRAM, IPPROTO_UDP)) < 0)
+    {
+	errors += _(" server socket");
+	return -1;
+    }
+
+    int reuse = 1;
+    if (setsockopt(fd, SOL_SOCKET, SO_REUSEADDR,
+		   (char *)&reuse, sizeof(reuse)) < 0)
+    {
+	errors += " SO_REUSEADDR";
+	close(fd);
+	return -1;
+    }
+
+    struct sockaddr_in server;
+    memset((char *) &server, 0, sizeof(server));
+    server.sin_family = AF_INET;
+    server.sin_port = htons(BSP_PORT);
+    server.sin_addr.s_addr = INADDR_ANY;
+
+    // make it receive-ready.
+    if (bind(fd, (struct sockaddr*)&server, sizeof(server)) == -1)
+    {
+	errors += " bind";
+	close(fd);
+	return -1;
+    }
+
+    // multicast join.
+    struct ip_mreq multicast_req;
+    multicast_req.imr_multiaddr.s_addr = inet_addr(BSP_MULTICAST);
+    multicast_req.imr_interface.s_addr = interface.s_addr;
+    if (setsockopt(fd, IPPROTO_IP, IP_ADD_MEMBERSHIP,
+		   (char *)&multicast_req, sizeof(multicast_req)) < 0)
+    {
+	errors += " IP_ADD_MEMBERSHIP";
+	close(fd);
+	return -1;
+    }
+
+    // bind(2) leaves us ready for recvfrom(2) calls.
+    return fd;
+}
+
+// classic BPF, run by the kernel on each datagram for this socket,
+// sees the UDP header ahead of our packet.  it refuses what CheckPacket()
+// would for fixed header values -- size, magic, version, type, packet
+// count -- and, if own is given, our own echo.  out-of-range loads
+// refuse, too.  without filter, any filter is detached.  no socket
+// yet (fd < 0) succeeds: it is applied when the socket is made.
+#ifdef linux
+#include <netinet/udp.h>
+#include <linux/filter.h>
+#include <linux/sock_diag.h>
+#endif /* linux */
+
+bool BibleSync::AttachFilter(int fd, bool filter, const uuid_t *own)
+{
+#ifdef linux
+    if (fd < 0)
+	return true;
+    if (!filter)
+    {
+	int unused = 0;
+	return ((setsockopt(fd, SOL_SOCKET, SO_DETACH_FILTER,
+			    (char *)&unused, sizeof(unused)) >= 0) ||
+		(errno == ENOENT));	// there was none.
+    }
+
+#define	AT(field)	\
+	(uint32_t)(sizeof(struct udphdr) + offsetof(BibleSyncMessage, field))
+#define	NEXT		(n + 1)
+#define	EMIT(code, k)	\
+	program[n] = (struct sock_filter)BPF_STMT(code, k), ++n
+#define	TEST(code, k, yes, no)	\
+	program[n] = (struct sock_filter)BPF_JUMP(code, k,		\
+						  (uint8_t)((yes) - n - 1), \
+						  (uint8_t)((no) - n - 1)), ++n
+
+    const int checks = 16, echo = (own ? 8 : 0);
+    const int accept = checks + echo, refuse = accept + 1;
+    struct sock_filter program[refuse + 1];
+    int n = 0;
+
+    EMIT(BPF_LD  | BPF_W | BPF_LEN, 0);
+    TEST(BPF_JMP | BPF_JGE | BPF_K, AT(body), NEXT, refuse);
+    EMIT(BPF_LD  | BPF_W | BPF_ABS, AT(magic));
+    TEST(BPF_JMP | BPF_JEQ | BPF_K, ntohl(BSP_MAGIC), NEXT, refuse);
+    EMIT(BPF_LD  | BPF_B | BPF_ABS, AT(version));
+    TEST(BPF_JMP | BPF_JEQ | BPF_K, BSP_PROTOCOL, n + 2, NEXT);
+    TEST(BPF_JMP | BPF_JEQ | BPF_K, BSP_OLD_PROTOCOL, NEXT, refuse);
+    EMIT(BPF_LD  | BPF_B | BPF_ABS, AT(msg_type));
+    TEST(BPF_JMP | BPF_JGE | BPF_K, BSP_ANNOUNCE, NEXT, refuse);
+    TEST(BPF_JMP | BPF_JGT | BPF_K, BSP_CHAT, refuse, NEXT);
+    EMIT(BPF_LD  | BPF_B | BPF_ABS, AT(num_packets));
+    TEST(BPF_JMP | BPF_JGE | BPF_K, 1, NEXT, refuse);
+    TEST(BPF_JMP | BPF_JGT | BPF_K, BSP_FRAGMENTS_MAX, refuse, NEXT);
+    EMIT(BPF_MISC | BPF_TAX, 0);
+    EMIT(BPF_LD  | BPF_B | BPF_ABS, AT(index_packet));
+    TEST(BPF_JMP | BPF_JGE | BPF_X, 0, refuse, NEXT);
+
+    // our uuid, a word at a time: all four alike is an echo.
+    for (int i = 0; i < echo / 2; ++i)
+    {
+	uint32_t word;
+	memcpy((void *)&word, (const char *)own + 4 * i, sizeof(word));
+	EMIT(BPF_LD  | BPF_W | BPF_ABS, AT(uuid) + 4 * i);
+	TEST(BPF_JMP | BPF_JEQ | BPF_K, ntohl(word),
+	     ((i == echo / 2 - 1) ? refuse : NEXT), accept);
+    }
+
+    EMIT(BPF_RET | BPF_K, 0xffffffff);		// accept: all of it.
+    EMIT(BPF_RET | BPF_K, 0);			// refuse.
+
+#undef	AT
+#undef	NEXT
+#undef	EMIT
+#undef	TEST
+
+    struct sock_fprog fprog = { (unsigned short)n, program };
+    return (setsockopt(fd, SOL_SOCKET, SO_ATTACH_FILTER,
+		       (char *)&fprog, sizeof(fprog)) >= 0);
+#else
+    return !filter;
+#endif /* linux */
+}
+
+// datagrams the kernel dropped on this socket: those our filter
+// refused, and those for which the receive buffer had no room.
+uint64_t BibleSync::KernelDrops(int fd)
+{
+#if defined(linux) && defined(SO_MEMINFO)
+    uint32_t meminfo[SK_MEMINFO_VARS];
+    socklen_t length = sizeof(meminfo);
+
+    if ((fd >= 0) &&
+	(getsockopt(fd, SOL_SOCKET, SO_MEMINFO, meminfo, &length) >= 0) &&
+	(length > SK_MEMINFO_DROPS * sizeof(uint32_t)))
+	return meminfo[SK_MEMINFO_DROPS];
+#endif
+    return 0;
+}
+
 // disposal of network access.
 void BibleSync::Shutdown()
 {
+    // receiver thread shutdown, with delivery of whatever it left behind.
+    StopReceiver();
+    shutdown_pending = false;
+
     // managed speaker list shutdown.
     clearSpeakers();
 
-    // network shutdown.
+    // held navigation has nowhere to go.
+    pending.clear();
+
+    // whoever we heard, we may not hear again.
+    inbound.peers.caps.clear();
+    for (int bit = 0; bit < BSP_CAP_BITS; ++bit)
+	inbound.peers.lacking[bit].store(0, std::memory_order_relaxed);
+    inbound.peers.overflow.store(false, std::memory_order_relaxed);
+    inbound.by_uuid.buckets.clear();
+    inbound.by_source.buckets.clear();
+
+    // a batch part-handled came from the socket we are closing.
+    budget.held = budget.next = 0;
+
+    // network shutdown, keeping count of what the kernel dropped.
+    Count(BSP_STAT_KERNEL_DROPPED, KernelDrops(server_fd));
     close(server_fd);
     close(client_fd);
     server_fd = client_fd = -1;
@@ -316,6 +773,8 @@ void BibleSync::Shutdown()
     // internal shutdown.
     mode = BSP_MODE_DISABLE;
     nav_func = NULL;
+    event_func = NULL;
+    event_data = NULL;
 }
 
 // pick the OS' generation flavor.
@@ -329,579 +788,2450 @@ void BibleSync::uuid_gen(uuid_t &u)
 }
 
 // conversion of UUID to printable form.
-void BibleSync::uuid_dump(uuid_t &u, char *destination)
+void BibleSync::uuid_dump(const uuid_t &u, char *destination)
 {
-    unsigned char *s = (unsigned char *)&u;
+    const unsigned char *s = (const unsigned char *)&u;
     snprintf((char *)destination, BSP_UUID_PRINT_LENGTH,
 	     "%02x%02x%02x%02x-%02x%02x-%02x%02x-%02x%02x-%02x%02x%02x%02x%02x%02x",
 	      s[0],  s[1],  s[2],  s[3],  s[4],  s[5],  s[6],  s[7],
 	      s[8],  s[9], s[10], s[11], s[12], s[13], s[14], s[15]);
 }
 
-// receiver, object-less, generally from C.
-// to be called with "myself" as userdata.
-// this exists so as to be able to dive from object-less C context
-// into C++ context with reference to "this", the BibleSync object.
-int BibleSync::Receive(void *myself)
+#define	DEBUG_LENGTH	(4*BSP_MAX_SIZE)	// print is bigger than raw
+
+// event delivery to the application.
+// the packet dump is rendered only as the dump mode requires:
+// always, for errors only, or never.  the app may still ask
+// for it explicitly via getDump() while handling the event.
+void BibleSync::Deliver(char cmd, const uuid_t *speaker,
+			string_view speakerkey,
+			string_view bible, string_view ref, string_view alt,
+			string_view group, string_view domain,
+			string_view info,
+			bool xmit_lock)
 {
-    // dive back into object context.
-    return ((BibleSync *)myself)->ReceiveInternal();
-}
+    if (!HasCallback())
+	return;
 
-// receiver, in C++ object context.
-// note that, in expected usage, and per usage by glib's g_timeout_add(),
-// return TRUE means the function is prepared to be called again,
-// and return FALSE means the function calls should stop until something
-// changes.  we return FALSE only when mode has been set to BSP_MODE_DISABLE.
-// ==> THEREFORE...
-// whenever the application sets any enabled mode, it must also arrange for
-// Receive() to begin being called regularly.
+    string_view dump;
+    if ((dump_mode == BSP_DUMP_ALWAYS) ||
+	((dump_mode == BSP_DUMP_ERRORS) && (cmd == 'E')))
+	dump = RenderDump();
 
-#define	DEBUG_LENGTH	(4*BSP_MAX_SIZE)	// print is bigger than raw
+    Dispatch(cmd, speaker, speakerkey,
+	     bible, ref, alt, group, domain,
+	     info, dump, xmit_lock);
+}
 
-int BibleSync::ReceiveInternal()
+// hand an event to the app, or, from the receiver thread,
+// queue it for the app's own thread to pick up in Receive().
+// xmit_lock: the app may not Transmit() from within this event.
+void BibleSync::Dispatch(char cmd, const uuid_t *speaker,
+			 string_view speakerkey,
+			 string_view bible, string_view ref, string_view alt,
+			 string_view group, string_view domain,
+			 string_view info, string_view dump,
+			 bool xmit_lock)
 {
-    if (mode == BSP_MODE_DISABLE)
-	return FALSE;				// done: un-schedule polling.
-
-    // nav_func unset => no point trying; no network => just leave.
-    if ((nav_func == NULL) || (server_fd < 0))
-	return TRUE;
+    // an error's particulars go with this event, and no other.
+    BibleSync_error error = ((cmd == 'E') ? error_at_hand : BSP_ERROR_NONE);
+    uint32_t repeats = error_repeats;
+    error_at_hand = BSP_ERROR_NONE;
 
-    char dump[DEBUG_LENGTH];
-    struct sockaddr_in source;
-    BibleSyncMessage bsp;
-    int recv_size = 0;
+    if (!HasCallback())
+	return;
 
-    // anything non-empty here is at least legitimate network traffic.
-    // whether it passes muster for BibleSync is another matter.
-    while ((recv_size = InitSelectRead(dump, &source, &bsp)) > 0)
+    if (OnReceiverThread())
     {
-	if (recv_size < BSP_HEADER_SIZE)
+	uint32_t tail = queue_tail.load(std::memory_order_relaxed);
+	if (tail - queue_head.load(std::memory_order_acquire)
+	    >= BSP_EVENT_QUEUE)
 	{
-	    (*nav_func)('E', EMPTY,
-			EMPTY, EMPTY, EMPTY, EMPTY, EMPTY,
-			BSP + _("packet too short"), dump);
-	    continue;
+	    ++queue_lost;		// full: app is not keeping up.
+	    return;
 	}
 
-	((char*)&bsp)[recv_size] = '\0';	// as an ordinary C string
-
-	// dump content into something humanly useful.
-	uuid_dump(bsp.uuid, uuid_dump_string);
-	snprintf(dump, DEBUG_LENGTH-1,
-		 "[%s]\nmagic: 0x%08x\nversion: 0x%02x\ntype: 0x%02x (%s)\n"
-		 "uuid: %s\n#pkt: %d\npkt index: %d\n\n-*- body -*-\n%s",
-		 inet_ntoa(source.sin_addr),
-		 ntohl(bsp.magic), bsp.version,
-		 bsp.msg_type, ((bsp.msg_type == BSP_ANNOUNCE)
-				? "announce"
-				: ((bsp.msg_type == BSP_SYNC)
-				   ? "sync"
-				   : ((bsp.msg_type == BSP_BEACON)
-				      ? "beacon"
-				      : ((bsp.msg_type == BSP_CHAT)
-					 ? "chat"
-					 : "*???*")))),
-		 uuid_dump_string,
-		 bsp.num_packets, bsp.index_packet,
-		 bsp.body);
-
-	// validate message: fixed values.
-	if (bsp.magic != BSP_MAGIC)
-	    (*nav_func)('E', EMPTY,
-			EMPTY, EMPTY, EMPTY, EMPTY, EMPTY,
-			BSP + _("bad magic"), dump);
-	else if ((bsp.version != BSP_PROTOCOL) && (bsp.version != BSP_OLD_PROTOCOL))
-	    // we are fine with previous v2 protocol that lacks chat messages.
-	    (*nav_func)('E', EMPTY,
-			EMPTY, EMPTY, EMPTY, EMPTY, EMPTY,
-			BSP + _("bad protocol version"), dump);
-	else if ((bsp.msg_type != BSP_ANNOUNCE) &&
-		 (bsp.msg_type != BSP_SYNC) &&
-		 (bsp.msg_type != BSP_BEACON) &&
-		 (bsp.msg_type != BSP_CHAT))
-	    (*nav_func)('E', EMPTY,
-			EMPTY, EMPTY, EMPTY, EMPTY, EMPTY,
-			BSP + _("bad msg type"), dump);
-	else if (bsp.num_packets != 1)
-	    (*nav_func)('E', EMPTY,
-			EMPTY, EMPTY, EMPTY, EMPTY, EMPTY,
-			BSP + _("bad packet count"), dump);
-	else if (bsp.index_packet != 0)
-	    (*nav_func)('E', EMPTY,
-			EMPTY, EMPTY, EMPTY, EMPTY, EMPTY,
-			BSP + _("bad packet index"), dump);
-
-	// basic header sanity tests passed.  now parse body content.
+	BibleSyncQueuedEvent &e = event_queue[tail % BSP_EVENT_QUEUE];
+	e.cmd = cmd;
+	uuid_assign(e.speaker, speaker);
+	e.speakerkey.assign(speakerkey);
+	e.bible.assign(bible);
+	e.ref.assign(ref);
+	e.alt.assign(alt);
+	e.group.assign(group);
+	e.domain.assign(domain);
+	e.info.assign(info);
+	e.dump.assign(dump);
+	e.xmit_lock = xmit_lock;
+	e.error = error;
+	e.repeats = repeats;
+	strcpy(e.source, ((error != BSP_ERROR_NONE) ? error_source : ""));
+	queue_tail.store(tail + 1, std::memory_order_seq_cst);
+	Wake();
+	return;
+    }
+
+    BibleSync_event event;
+    event.cmd        = cmd;
+    uuid_assign(event.speaker, speaker);
+    event.speakerkey = speakerkey;
+    event.bible      = bible;
+    event.ref        = ref;
+    event.alt        = alt;
+    event.group      = group;
+    event.domain     = domain;
+    event.info       = info;
+    event.dump       = dump;
+    event.object     = this;
+    event.error      = error;
+    event.repeats    = repeats;
+    event.source     = ((error != BSP_ERROR_NONE) ? error_source : "");
+    DeliverEvent(event, xmit_lock);
+}
+
+// an error's whole text, as nav_func has always had it in info.
+static string error_info(const BibleSync_event &event)
+{
+    string info = BSP;
+
+    if ((event.error > BSP_ERROR_NONE) && (event.error < N_BSP_ERROR))
+	info += translated(event.error);
+    if (!event.info.empty())
+    {
+	info += ": ";
+	info += event.info;
+    }
+    if (event.repeats > 0)
+    {
+	char more[128];
+
+	if (event.source.empty())
+	    snprintf(more, sizeof(more), translated(TEXT_MORE).data(),
+		     event.repeats);
 	else
+	    snprintf(more, sizeof(more), translated(TEXT_MORE_FROM).data(),
+		     event.repeats,
+		     (int)event.source.length(), event.source.data());
+	info += " ";
+	info += more;
+    }
+    return info;
+}
+
+// the last step: the app's callback, of whichever kind.
+// the legacy nav_func is served by copying the views into strings.
+void BibleSync::DeliverEvent(const BibleSync_event &event, bool xmit_lock)
+{
+    static const char event_cmds[] = "ANSDCME";	// as BSP_STAT_EVENT_*.
+    const char *which = strchr(event_cmds, event.cmd);
+    if ((which != NULL) && (event.cmd != '\0'))
+	Count((BibleSync_stat)(BSP_STAT_EVENT_A + (which - event_cmds)));
+
+    if (xmit_lock)
+	receiving = true;			// re-xmit lock.
+
+    if (event_func != NULL)
+	(*event_func)(event, event_data);
+    else if (nav_func != NULL)
+	(*nav_func)(event.cmd, string(event.speakerkey),
+		    string(event.bible), string(event.ref),
+		    string(event.alt), string(event.group),
+		    string(event.domain),
+		    ((event.error != BSP_ERROR_NONE)
+		     ? error_info(event) : string(event.info)),
+		    string(event.dump));
+
+    if (xmit_lock)
+	receiving = false;			// re-xmit unlock.
+}
+
+// the app's side of the receiver thread: deliver all queued events.
+// never waits.
+void BibleSync::DispatchQueue()
+{
+    // the app may disable us, which empties the queue from within.
+    if (dispatching)
+	return;
+    dispatching = true;
+
+    uint32_t lost = queue_lost.exchange(0);
+    if (lost > 0)
+    {
+	char count[16];
+	snprintf(count, sizeof(count), "%u", lost);
+	ReportError(BSP_ERROR_EVENTS_LOST, count, NULL);
+    }
+
+    uint32_t head = queue_head.load(std::memory_order_relaxed);
+    while (head != queue_tail.load(std::memory_order_acquire))
+    {
+	BibleSyncQueuedEvent &e = event_queue[head % BSP_EVENT_QUEUE];
+
+	if (HasCallback())
 	{
-	    bool ok_so_far(true);
-	    char *name, *value;
-	    BibleSyncContent content;
+	    BibleSync_event event;
+	    event.cmd        = e.cmd;
+	    memcpy((void *)event.speaker, (const void *)e.speaker,
+		   sizeof(uuid_t));
+	    event.speakerkey = e.speakerkey;
+	    event.bible      = e.bible;
+	    event.ref        = e.ref;
+	    event.alt        = e.alt;
+	    event.group      = e.group;
+	    event.domain     = e.domain;
+	    event.info       = e.info;
+	    event.dump       = e.dump;
+	    event.object     = this;
+	    event.error      = e.error;
+	    event.repeats    = e.repeats;
+	    event.source     = e.source;
+
+	    dispatch_dump = &e.dump;
+	    DeliverEvent(event, e.xmit_lock);
+	    dispatch_dump = NULL;
+	}
 
-	    // structure test and content retrieval
-	    // "name=value\n" for each.
-	    for (char *s = bsp.body; ok_so_far && *s; ++s)
-	    {
-		name = s;
-		// newline terminator of name/value pair.
-		if ((s = strchr(s, '\n')) == NULL)
-		{
-		    ok_so_far = false;
-		    break;
-		}
-		else
-		{
-		    *s = '\0';	// NUL-terminate assignment (end of value).
+	queue_head.store(++head, std::memory_order_release);
+    }
 
-		    // separator ('=') between name and value.
-		    if ((value = strchr(name, '=')) == NULL)
-		    {
-			ok_so_far = false;
-			break;
-		    }
-		    else
-		    {
-			*(value++) = '\0';	// NUL-terminate name.
+    dispatching = false;
+}
 
-			// valid content.
-			content[name] = value;
-		    }
-		}
-	    }
+// the packet dump, on the app's request from within nav_func.
+// for events from the receiver thread, only what dump mode provided.
+string BibleSync::getDump(void)
+{
+    if (dispatch_dump != NULL)
+	return ((*dispatch_dump != EMPTY)
+		? *dispatch_dump
+		: (string)_("[no dump ready]"));
+    return string(RenderDump());
+}
 
-	    if (!ok_so_far)
-	    {
-		(*nav_func)('E', EMPTY,
-			    EMPTY, EMPTY, EMPTY, EMPTY, EMPTY,
-			    BSP + _("bad body format"), dump);
-	    }
-	    else
-	    {
-		// verify minimum body content.
-		int field_count = inbound_required_count[bsp.msg_type];
+// render the packet currently being handled into something humanly useful.
+// valid only while handling a received packet; the text is in the arena.
+string_view BibleSync::RenderDump(void)
+{
+    if (dump_packet == NULL)
+	return _("[no dump ready]");
 
-		for (int i = 0; i < field_count; ++i)
-		{
-		    string &locator = (((bsp.msg_type == BSP_CHAT) &&
-					(i == CHAT_INBOUND_INDEX))
-				       ? chat_field
-				       : inbound_required[i]);
+    char *dump = (char *)arena.allocate(DEBUG_LENGTH, 1);
+    const BibleSyncMessage &bsp = *dump_packet;
 
-		    if (content.find(locator) == content.end())
-		    {
-			ok_so_far = false;
-			string info = BSP + _("missing required header ")
-			    + inbound_required[i]
-			    + ".";
-			(*nav_func)('E', EMPTY,
-				    EMPTY, EMPTY, EMPTY, EMPTY, EMPTY,
-				    info, dump);
-			// don't break -- find all missing.
-		    }
-		}
+    if (dump_size < BSP_HEADER_SIZE)
+    {
+	snprintf(dump, DEBUG_LENGTH-1, "[%s]\n(short packet: %d bytes)",
+		 inet_ntoa(dump_source->sin_addr), dump_size);
+	return dump;
+    }
 
-		if (ok_so_far)
-		{
-		    // find listening status for this guy.
-		    string pkt_uuid = content.find(BSP_APP_INSTANCE_UUID)->second;
-		    BibleSyncSpeakerMapIterator object = speakers.find(pkt_uuid);
-		    string source_addr = inet_ntoa(source.sin_addr);
-		    bool listening;
-
-		    // spoof & listen check:
-		    if (object != speakers.end())
-		    {
-			// is some legit xmitter's UUID being borrowed?
-			if (object->second.addr != source_addr)	// spoof?
-			{
-			    // spock: "forbid...forbid!"
-			    (*nav_func)('M', pkt_uuid,
-					EMPTY, EMPTY, EMPTY, EMPTY, EMPTY,
-					BSP + _("Spoof stopped: ") + pkt_uuid
-						+ " from " + source_addr
-						+ " instead of "
-						+ object->second.addr,
-					dump);
-			    continue;
-			}
-			listening = object->second.listen;
-		    }
-		    else
-		    {
-			listening = false;	// not in map => ignore.
-		    }
+    char uuid_print[BSP_UUID_PRINT_LENGTH];
+    uuid_dump(bsp.uuid, uuid_print);
 
-		    // loopback is enabled: reject self-uuid packets.
-		    unsigned int i;
-		    unsigned char *incoming = (unsigned char *)&uuid;
-		    unsigned char *mine     = (unsigned char *)&bsp.uuid;
-		    for (i = 0; i < sizeof(uuid_t); ++i)
-		    {
-			if (incoming[i] != mine[i])
-			    break;	// not ourselves.
-		    }
-		    // if we end the loop without early break,
-		    // then we matched UUID for ourselves.
-		    // i.e. we're hearing an echo of ourselves.  ignore.
-		    if (i == sizeof(uuid_t))
-		    {
-#if 0
-			(*nav_func)('E', pkt_uuid,
-				    EMPTY, EMPTY, EMPTY, EMPTY, EMPTY,
-				    BSP + _("Ignoring echo."), dump);
-#endif
-			continue;
-		    }
-		    
-		    // give reference items initial filler content.
-		    string bible = "<>", ref = "<>", alt = "<>",
-			group = "<>", domain = "<>",
-			info = "<>";
-		    char cmd;
-
-		    string version;
-		    auto ver_it = content.find(BSP_APP_VERSION);
-		    if (ver_it != content.end())
-			version = ver_it->second;
-		    if (version == "")
-			version = (string)"(version?)";
-		
-		    // generally good, so extract interesting content.
-		    if (bsp.msg_type == BSP_CHAT)
-		    {
-			bible  = content.find(BSP_APP_USER)->second;
-			ref    = source_addr;
-			group  = content.find(BSP_APP_NAME)->second
-			    + " " + version;
-			{
-			    auto dev_it = content.find(BSP_APP_DEVICE);
-			    if (dev_it != content.end())
-				domain = dev_it->second;
-			}
-			alt    = content.find(BSP_MSG_CHAT)->second;
-
-			info = (string)"chat: "
-			    + content.find(BSP_APP_USER)->second
-			    + " @ " + source_addr;
-
-			cmd = ((passphrase ==
-				content.find(BSP_MSG_PASSPHRASE)->second)
-			       ? 'C'	// chat message
-			       : 'M');	// mismatch
-		    }
-		    else if (bsp.msg_type == BSP_SYNC)
-		    {
-			// regular synchronized navigation
-			bible  = content.find(BSP_MSG_SYNC_BIBLEABBREV)->second;
-			ref    = content.find(BSP_MSG_SYNC_VERSE)->second;
-			{
-			    auto alt_it = content.find(BSP_MSG_SYNC_ALTVERSE);
-			    if (alt_it != content.end())
-				alt = alt_it->second;
-			}
-			group  = content.find(BSP_MSG_SYNC_GROUP)->second;
-			domain = content.find(BSP_MSG_SYNC_DOMAIN)->second;
-
-			if (domain != "BIBLE-VERSE")
-			{
-			    cmd = 'E';
-			    info = BSP
-				+ _("Domain not 'BIBLE-VERSE': ")
-				+ domain;
-			} else if ((group.length() != 1) ||
-				   (group.c_str()[0] < '1') ||
-				   (group.c_str()[0] > '9'))
-			{
-			    cmd = 'E';
-			    info = BSP
-				+ _("Invalid group: ")
-				+ group;
-			}
-			else if (((mode == BSP_MODE_PERSONAL) ||  // (receiver ||
-				  (mode == BSP_MODE_AUDIENCE)) && //  receiver) &&
-				 listening &&			  // being heard &&
-				 (passphrase ==			  // match
-				  content.find(BSP_MSG_PASSPHRASE)->second))
-			{
-			    cmd = 'N';	// navigation
-			}
-			else
-			{
-			    cmd = 'M';	// mismatch
-			    info = (string)"sync: "
-				+ content.find(BSP_APP_USER)->second
-				+ " @ " + source_addr;
-			}
-		    }
-		    else if (bsp.msg_type == BSP_ANNOUNCE)
-		    {
-			// construct user's presence announcement
-			bible  = content.find(BSP_APP_USER)->second;
-			ref    = source_addr;
-			group  = content.find(BSP_APP_NAME)->second
-			    + " " + version;
-			{
-			    auto dev_it = content.find(BSP_APP_DEVICE);
-			    if (dev_it != content.end())
-				domain = dev_it->second;
-			}
-
-			alt = BSP
-			    + content.find(BSP_APP_USER)->second
-			    + _(" present at ")
-			    + source_addr
-			    + _(" using ")
-			    + group
-			    + ".";
-
-			info = (string)"announce: "
-			    + content.find(BSP_APP_USER)->second
-			    + " @ " + source_addr;
-
-			cmd = ((passphrase ==
-				content.find(BSP_MSG_PASSPHRASE)->second)
-			       ? 'A'	// presence announcement
-			       : 'M');	// mismatch
-		    }
-		    else // bsp.msg_type == BSP_BEACON
-		    {
-			bible  = content.find(BSP_APP_USER)->second;
-			ref    = source_addr;
-			group  = content.find(BSP_APP_NAME)->second
-			    + " " + version;
-			{
-			    auto dev_it = content.find(BSP_APP_DEVICE);
-			    if (dev_it != content.end())
-				domain = dev_it->second;
-			}
-
-			info = (string)"beacon: "
-			    + content.find(BSP_APP_USER)->second
-			    + " @ " + source_addr;
-
-			if (passphrase ==
-			    content.find(BSP_MSG_PASSPHRASE)->second)
-			{
-			    cmd = ((object == speakers.end())
-				   ? 'S'	// unknown: potential speaker.
-				   : 'x');	// known: don't tell app again.
-
-			    unsigned int old_speakers_size, new_speakers_size;
-			    old_speakers_size = speakers.size();
-
-			    // whether previously known or not,
-			    // a beacon (re)starts the aging countdown.
-			    speakers[pkt_uuid].countdown =
-				beacon_count * BSP_BEACON_MULTIPLIER;
-
-			    new_speakers_size = speakers.size();
-
-			    // record address for first-time-seen beacon,
-			    // for anti-spoof checks in the future.
-			    if (cmd == 'S')
-				speakers[pkt_uuid].addr = source_addr;
-
-			    if (mode == BSP_MODE_SPEAKER)
-			    {
-				// speaker listens to no one.
-				speakers[pkt_uuid].listen = false;
-			    }
-			    else
-			    {
-				// listen to 1st speaker, ignore everyone else.
-				// the app can make other choices.
-				if (cmd == 'S')
-				{
-				    speakers[pkt_uuid].listen =
-					((old_speakers_size == 0) &&
-					 (new_speakers_size == 1));
-				}
-				// else someone previously known: don't touch.
-			    }
-			}
-			else
-			{
-			    cmd = 'M';		// mismatch.
-			}
-		    }
+    // a compressed or TLV body is shown decoded.
+    const char *body = dump_body;
+    if (bsp.reserved[BSP_RES_BODY] != BSP_BODY_TEXT)
+    {
+	BibleSyncFields fields;
+	char uuid_text[BSP_UUID_PRINT_LENGTH];
+	char *decoded = (char *)arena.allocate(DEBUG_LENGTH, 1);
+	int length = snprintf(decoded, DEBUG_LENGTH, "%s",
+			      ((bsp.reserved[BSP_RES_BODY] == BSP_BODY_TLV)
+			       ? _("(TLV)\n") : _("(compressed)\n")));
+
+	if (ParseEncoded(bsp, dump_body, dump_size - BSP_HEADER_SIZE,
+			 fields, uuid_text))
+	{
+	    for (int i = 0; i < N_BSP_FIELD; ++i)
+		if ((fields.present & BSP_FIELD_BIT(i)) &&
+		    (length < DEBUG_LENGTH))
+		    length += snprintf(decoded + length,
+				       DEBUG_LENGTH - length, "%s=%.*s\n",
+				       field_names[i].name,
+				       (int)fields.value[i].length(),
+				       fields.value[i].data());
+	}
+	else
+	    snprintf(decoded + length, DEBUG_LENGTH - length, "%s",
+		     _("[malformed]"));
+	body = decoded;
+    }
 
-		    // delivery to application.
-		    if (cmd != 'x')
-		    {
-			receiving = true;			// re-xmit lock.
-			(*nav_func)(cmd, pkt_uuid,
-				    bible, ref, alt, group, domain,
-				    info, dump);
-			receiving = false;			// re-xmit unlock.
-		    }
-		}
-	    }
+    snprintf(dump, DEBUG_LENGTH-1,
+	     "[%s]\nmagic: 0x%08x\nversion: 0x%02x\ntype: 0x%02x (%s)\n"
+	     "uuid: %s\n#pkt: %d\npkt index: %d\n\n-*- body -*-\n%s",
+	     inet_ntoa(dump_source->sin_addr),
+	     ntohl(bsp.magic), bsp.version,
+	     bsp.msg_type, ((bsp.msg_type == BSP_ANNOUNCE)
+			    ? "announce"
+			    : ((bsp.msg_type == BSP_SYNC)
+			       ? "sync"
+			       : ((bsp.msg_type == BSP_BEACON)
+				  ? "beacon"
+				  : ((bsp.msg_type == BSP_CHAT)
+				     ? "chat"
+				     : "*???*")))),
+	     uuid_print,
+	     bsp.num_packets, bsp.index_packet,
+	     body);
+    return dump;
+}
+
+// text made of pieces, in the arena: valid until the next packet.
+string_view BibleSync::Compose(std::initializer_list<string_view> pieces)
+{
+    size_t length = 0;
+
+    for (string_view piece : pieces)
+	length += piece.length();
+
+    char *text = (char *)arena.allocate(length + 1, 1), *s = text;
+    for (string_view piece : pieces)
+    {
+	memcpy(s, piece.data(), piece.length());
+	s += piece.length();
+    }
+    *s = '\0';
+    return string_view(text, length);
+}
+
+// zero-copy body decoder.
+// "name=value\n" for each.  known names land in their slots as views
+// into the body, which is left intact; unknown names are skipped.
+// returns false for a malformed body.
+bool BibleSync::ParseBody(const char *body, int length,
+			  BibleSyncFields &fields)
+{
+    const char *s = body, *end = body + strnlen(body, length);
+
+    fields.present = 0;
+    while (s < end)
+    {
+	// newline terminator of name/value pair.
+	const char *eol = (const char *)memchr(s, '\n', end - s);
+	if (eol == NULL)
+	    return false;
+
+	// separator ('=') between name and value.
+	const char *value = (const char *)memchr(s, '=', eol - s);
+	if (value == NULL)
+	    return false;
+
+	int i = field_index(s, value - s);
+	if (i >= 0)
+	{
+	    ++value;
+	    fields.value[i] = string_view(value, eol - value);
+	    fields.present |= BSP_FIELD_BIT(i);
+	}
+	s = eol + 1;
+    }
+    return true;
+}
+
+// compressed body decoder: as ParseBody(), with a token for each name.
+bool BibleSync::ParseCompressed(const char *body, int length,
+				BibleSyncFields &fields)
+{
+    const char *s = body, *end = body + strnlen(body, length);
+
+    fields.present = 0;
+    while (s < end)
+    {
+	const char *eol = (const char *)memchr(s, '\n', end - s);
+	if (eol == NULL)
+	    return false;
+
+	int i = (unsigned char)*s - BSP_TOKEN_NAME;
+	if ((i < 0) || (i >= N_BSP_FIELD))
+	    return false;
+
+	string_view value(s + 1, eol - (s + 1));
+	if ((value.length() == 1) &&
+	    (value[0] >= 1) && (value[0] <= BSP_TOKEN_VALUES))
+	    value = value_table[value[0] - 1];
+	fields.value[i] = value;
+	fields.present |= BSP_FIELD_BIT(i);
+	s = eol + 1;
+    }
+    return true;
+}
+
+// TLV body decoder: tag, 2-byte length, value; bounds checks only.
+bool BibleSync::ParseTLV(const char *body, int length,
+			 BibleSyncFields &fields)
+{
+    const uint8_t *s = (const uint8_t *)body, *end = s + length;
+
+    fields.present = 0;
+    while (s < end)
+    {
+	if (end - s < BSP_TLV_HEADER)
+	    return false;
+
+	size_t n = (s[1] << 8) | s[2];
+	if ((size_t)(end - s - BSP_TLV_HEADER) < n)
+	    return false;
+
+	int i = s[0] - BSP_TOKEN_NAME;
+	if ((i >= 0) && (i < N_BSP_FIELD))
+	{
+	    fields.value[i] = string_view((const char *)s + BSP_TLV_HEADER, n);
+	    fields.present |= BSP_FIELD_BIT(i);
+	}
+	s += BSP_TLV_HEADER + n;
+    }
+    return true;
+}
+
+// decode by the body's encoding, as its header says.  only text carries
+// the uuid as a field: otherwise, it is the header's, printed in uuid_text.
+// unknown encodings are taken as text.
+bool BibleSync::ParseEncoded(const BibleSyncMessage &bsp,
+			     const char *body, int length,
+			     BibleSyncFields &fields, char *uuid_text)
+{
+    switch (bsp.reserved[BSP_RES_BODY])
+    {
+    case BSP_BODY_COMPRESSED:
+	if (!ParseCompressed(body, length, fields))
+	    return false;
+	break;
+
+    case BSP_BODY_TLV:
+	if (!ParseTLV(body, length, fields))
+	    return false;
+	break;
+
+    default:
+	return ParseBody(body, length, fields);
+    }
+
+    uuid_dump(bsp.uuid, uuid_text);
+    fields.value[BSP_FIELD_APP_INSTANCE_UUID] = uuid_text;
+    fields.present |= BSP_FIELD_BIT(BSP_FIELD_APP_INSTANCE_UUID);
+    return true;
+}
+
+// note a sender's capabilities, as its header advertises them.
+void BibleSync::PeerHeard(BibleSyncPeers &peers, const BibleSyncMessage &bsp)
+{
+    uint64_t key[2];
+    uint8_t caps = bsp.reserved[BSP_RES_CAPS];
+
+    memcpy((void *)key, (const void *)&bsp.uuid, sizeof(key));
+    auto found = peers.caps.find(key[0] ^ key[1]);
+    if ((found != peers.caps.end()) && (found->second == caps))
+	return;				// as ever: by far the usual.
+
+    if (found != peers.caps.end())
+    {
+	for (int bit = 0; bit < BSP_CAP_BITS; ++bit)
+	    if (!(found->second & (1 << bit)))
+		peers.lacking[bit].fetch_sub(1, std::memory_order_relaxed);
+	found->second = caps;
+    }
+    else if (peers.caps.size() >= BSP_PEERS_MAX)
+    {
+	peers.overflow.store(true, std::memory_order_relaxed);
+	return;
+    }
+    else
+	peers.caps.emplace(key[0] ^ key[1], caps);
+
+    for (int bit = 0; bit < BSP_CAP_BITS; ++bit)
+	if (!(caps & (1 << bit)))
+	    peers.lacking[bit].fetch_add(1, std::memory_order_relaxed);
+}
+
+// token bucket: each packet takes a token, and they come back at
+// rate per second, up to burst.  a sender new to us starts full.
+bool BibleSync::Admit(BibleSyncLimit &limit, uint64_t key, uint64_t now)
+{
+    if (limit.rate == 0)
+	return true;
+
+    uint64_t full = (uint64_t)limit.burst * BSP_LIMIT_TOKEN;
+    auto found = limit.buckets.find(key);
+    if (found == limit.buckets.end())
+    {
+	if (limit.buckets.size() >= BSP_LIMIT_BUCKETS)
+	{
+	    // the refilled are forgotten at no cost; else the quietest.
+	    auto quietest = limit.buckets.end();
+	    for (auto it = limit.buckets.begin(); it != limit.buckets.end(); )
+	    {
+		if (it->second.tokens +
+		    (now - it->second.last) * limit.rate >= full)
+		    it = limit.buckets.erase(it);
+		else
+		{
+		    if ((quietest == limit.buckets.end()) ||
+			(it->second.last < quietest->second.last))
+			quietest = it;
+		    ++it;
+		}
+	    }
+	    if (limit.buckets.size() >= BSP_LIMIT_BUCKETS)
+		limit.buckets.erase(quietest);
+	}
+	found = limit.buckets.emplace(key, BibleSyncBucket{ full, now }).first;
+    }
+
+    // BSP_LIMIT_TOKEN is 1000: rate per second is rate per msec of it.
+    BibleSyncBucket &bucket = found->second;
+    bucket.tokens = min(full, bucket.tokens + (now - bucket.last) * limit.rate);
+    bucket.last = now;
+    if (bucket.tokens < BSP_LIMIT_TOKEN)
+	return false;
+    bucket.tokens -= BSP_LIMIT_TOKEN;
+    return true;
+}
+
+// new allowance: everyone starts over, full.  a burst below one
+// packet would refuse everything.
+void BibleSync::SetLimit(BibleSyncLimit &limit,
+			 unsigned int rate, unsigned int burst)
+{
+    limit.rate = rate;
+    limit.burst = max(burst, 1U);
+    limit.buckets.clear();
+}
+
+// every peer heard can decode what cap stands for.
+bool BibleSync::PeersCapable(const BibleSyncPeers &peers, uint8_t cap)
+{
+    if (peers.overflow.load(std::memory_order_relaxed))
+	return false;
+    for (int bit = 0; bit < BSP_CAP_BITS; ++bit)
+	if ((cap & (1 << bit)) &&
+	    (peers.lacking[bit].load(std::memory_order_relaxed) != 0))
+	    return false;
+    return true;
+}
+
+// binary UUID copied as is; zeroed if there is none.
+void BibleSync::uuid_assign(uuid_t &u, const uuid_t *from)
+{
+    if (from != NULL)
+	memcpy((void *)&u, (const void *)from, sizeof(uuid_t));
+    else
+	memset((void *)&u, 0, sizeof(uuid_t));
+}
+
+// conversion of printable UUID back to binary form.
+// false, with u zeroed, if it is not a well-formed UUID.
+bool BibleSync::uuid_scan(string_view key, uuid_t &u)
+{
+    unsigned char *d = (unsigned char *)&u;
+    int n = 0;
+
+    memset((void *)d, 0, sizeof(uuid_t));
+    if (key.length() != (BSP_UUID_PRINT_LENGTH - 1))
+	return false;
+
+    for (size_t i = 0; i < key.length(); )
+    {
+	if (key[i] == '-')
+	{
+	    ++i;
+	    continue;
+	}
+
+	int hi = hex_value(key[i]);
+	int lo = ((i + 1 < key.length()) ? hex_value(key[i + 1]) : -1);
+	if ((hi < 0) || (lo < 0) || (n == sizeof(uuid_t)))
+	{
+	    memset((void *)d, 0, sizeof(uuid_t));
+	    return false;
+	}
+	d[n++] = (hi << 4) | lo;
+	i += 2;
+    }
+
+    if (n != sizeof(uuid_t))
+    {
+	memset((void *)d, 0, sizeof(uuid_t));
+	return false;
+    }
+    return true;
+}
+
+// receiver, object-less, generally from C.
+// to be called with "myself" as userdata.
+// this exists so as to be able to dive from object-less C context
+// into C++ context with reference to "this", the BibleSync object.
+int BibleSync::Receive(void *myself)
+{
+    // dive back into object context.
+    return ((BibleSync *)myself)->ReceiveInternal();
+}
+
+// receiver, waiting up to timeout_ms (-1: indefinitely) for traffic.
+// waiting ends early when housekeeping (beacon, aging) falls due.
+int BibleSync::Receive(void *myself, int timeout_ms)
+{
+    return ((BibleSync *)myself)->ReceiveInternal(true, timeout_ms);
+}
+
+// receiver, in C++ object context.
+// note that, in expected usage, and per usage by glib's g_timeout_add(),
+// return TRUE means the function is prepared to be called again,
+// and return FALSE means the function calls should stop until something
+// changes.  we return FALSE only when mode has been set to BSP_MODE_DISABLE.
+// ==> THEREFORE...
+// whenever the application sets any enabled mode, it must also arrange for
+// Receive() to begin being called regularly.
+
+int BibleSync::ReceiveInternal(bool timed, int timeout_ms)
+{
+    // the receiver thread failed to xmit: it is up to us to stop.
+    if (shutdown_pending)
+	Shutdown();
+
+    if (mode == BSP_MODE_DISABLE)
+	return FALSE;				// done: un-schedule polling.
+
+    // the receiver thread does the work: we only deliver its results.
+    if (receiver.joinable())
+    {
+	if (timed)
+	    WaitQueued(timeout_ms);
+	DispatchQueue();
+	FlushCoalesced(false);
+	ArmWake();
+	return TRUE;
+    }
+
+    // a multiplexer does all our receiving and housekeeping.
+    if (mux != NULL)
+	return TRUE;
+
+    // nav_func unset => no point trying; no network => just leave.
+    if (!HasCallback() || (server_fd < 0))
+	return TRUE;
+
+    // event-driven use: sleep until there is something to do.
+    if (timed)
+	WaitReadable(timeout_ms);
+
+    return (ReceiveDrain() ? BSP_RECEIVE_MORE : TRUE);
+}
+
+// read and handle what is waiting, as much as the budget allows,
+// then housekeeping if due.  true if some was left waiting.
+bool BibleSync::ReceiveDrain(void)
+{
+    bool more = false;
+
+    // an event may disable us, closing the socket.
+    BudgetStart(budget);
+    while (server_fd >= 0)
+    {
+	if (BudgetSpent(budget))
+	{
+	    more = ((budget.next < budget.held) || Readable(server_fd));
+	    break;
+	}
+
+	// anything non-empty here is at least legitimate network traffic.
+	// whether it passes muster for BibleSync is another matter.
+	if (budget.next >= budget.held)
+	{
+	    budget.next = 0;
+	    budget.held = max(ReceiveBatch(BudgetBatch(budget)), 0);
+	    if (budget.held == 0)
+		break;
+	}
+
+	int i = budget.next++;
+	++budget.handled;
+	ReceivePacket(recv_buffer[i], recv_length[i], recv_source[i]);
+    }
+
+    ReceiveDone();
+    return more;
+}
+
+// a Receive()'s allowance starts now.
+void BibleSync::BudgetStart(BibleSyncBudget &b)
+{
+    b.handled = 0;
+    b.stop = ((b.msec != 0) ? now_msec() + b.msec : 0);
+}
+
+// no more this time.  one packet, at least, is always handled.
+bool BibleSync::BudgetSpent(const BibleSyncBudget &b)
+{
+    if (b.handled == 0)
+	return false;
+    return (((b.packets != 0) && (b.handled >= b.packets)) ||
+	    ((b.stop != 0) && (now_msec() >= b.stop)));
+}
+
+// how many to read at once: no more than may be handled.
+int BibleSync::BudgetBatch(const BibleSyncBudget &b)
+{
+    if ((b.packets == 0) || (b.packets - b.handled >= BSP_RECV_BATCH))
+	return BSP_RECV_BATCH;
+    return (int)(b.packets - b.handled);
+}
+
+// something waits to be read.  nothing is read.
+bool BibleSync::Readable(int fd)
+{
+#ifndef WIN32
+    struct pollfd pfd;
+    pfd.fd = fd;
+    pfd.events = POLLIN;
+    pfd.revents = 0;
+    return (poll(&pfd, 1, 0) > 0);
+#else
+    fd_set read_set;
+    struct timeval tv = { 0, 0 };
+    FD_ZERO(&read_set);
+    FD_SET(fd, &read_set);
+    return (select(fd+1, &read_set, NULL, NULL, &tv) > 0);
+#endif /* WIN32 */
+}
+
+void BibleSync::setReceiveBudget(unsigned int packets, unsigned int msec)
+{
+    std::lock_guard<std::recursive_mutex> guard(state_lock);
+
+    budget.packets = packets;
+    budget.msec = msec;
+}
+
+// after a drain: held navigation and housekeeping, whichever is due.
+void BibleSync::ReceiveDone(void)
+{
+    // packet context is gone: no more dumps from it.
+    dump_packet = NULL;
+    dump_source = NULL;
+    dump_size = 0;
+
+    // held navigation that has settled, and errors' repeats.
+    FlushCoalesced(false);
+    FlushErrors(false);
+
+    // beacons and aging follow the clock, not the rate of calls.
+    if ((next_tick != 0) && (now_msec() >= next_tick))
+	Housekeeping();
+
+    // the network may have moved under us.
+    FollowInterface();
+}
+
+// the app wants (or no longer wants) its own receiver thread.
+// it runs whenever a mode is enabled, and Receive() then only
+// delivers the events it has queued.
+bool BibleSync::setReceiverThread(bool run)
+{
+    receiver_wanted = run;
+
+    if (!run)
+	StopReceiver();
+    else if (mode != BSP_MODE_DISABLE)
+	StartReceiver();
+
+    return receiver.joinable();
+}
+
+void BibleSync::StartReceiver()
+{
+    if (receiver.joinable() || !HasCallback() || (server_fd < 0))
+	return;
+
+    if (event_queue.size() != BSP_EVENT_QUEUE)
+	event_queue.resize(BSP_EVENT_QUEUE);
+    receiver_stop = false;
+
+#ifndef WIN32
+    // made once, so the app's event loop may keep watching it.
+    if ((wake_fd[0] < 0) && (pipe(wake_fd) == 0))
+    {
+	fcntl(wake_fd[0], F_SETFL, O_NONBLOCK);
+	fcntl(wake_fd[1], F_SETFL, O_NONBLOCK);
+    }
+#endif
+    ArmWake();
+
+    // the thread's first act is to take state_lock,
+    // so it cannot look for receiver_id before it is set.
+    std::lock_guard<std::recursive_mutex> guard(state_lock);
+    receiver = std::thread(&BibleSync::ReceiverThread, this);
+    receiver_id = receiver.get_id();
+}
+
+// stop and reap the receiver thread, then deliver its leftovers.
+// never from the receiver thread itself.
+void BibleSync::StopReceiver()
+{
+    if (!receiver.joinable() || OnReceiverThread())
+	return;
+
+    receiver_stop = true;
+    receiver.join();
+    receiver_id = std::thread::id();
+    DispatchQueue();
+}
+
+bool BibleSync::OnReceiverThread()
+{
+    return (receiver_id == std::this_thread::get_id());
+}
+
+// the thread has queued something: tell the app, once per arming.
+void BibleSync::Wake(void)
+{
+    if (!wake_armed.exchange(false))
+	return;
+#ifndef WIN32
+    if (wake_fd[1] >= 0)
+	(void)!write(wake_fd[1], "", 1);
+#endif
+}
+
+// the app has taken what was queued: empty the pipe, and have the
+// next event refill it.  anything queued meanwhile fires at once.
+void BibleSync::ArmWake(void)
+{
+#ifndef WIN32
+    char drain[64];
+    if (wake_fd[0] >= 0)
+	while (read(wake_fd[0], drain, sizeof(drain)) > 0)
+	    ;
+#endif
+    wake_armed.store(true);
+    if ((queue_head.load() != queue_tail.load()) || shutdown_pending)
+	Wake();
+}
+
+// the app's thread sleeps up to timeout_ms (-1: indefinitely)
+// until the receiver thread has queued events.
+void BibleSync::WaitQueued(int timeout_ms)
+{
+#ifndef WIN32
+    if (wake_fd[0] >= 0)
+    {
+	struct pollfd pfd;
+	pfd.fd = wake_fd[0];
+	pfd.events = POLLIN;
+	pfd.revents = 0;
+	(void)poll(&pfd, 1, timeout_ms);
+	return;
+    }
+#endif
+    // no pipe: look again now and then.
+    if ((queue_head.load() == queue_tail.load()) && !shutdown_pending)
+	std::this_thread::sleep_for(std::chrono::milliseconds(
+	    ((timeout_ms < 0) || (timeout_ms > BSP_RECEIVER_WAKE_MSEC))
+	    ? BSP_RECEIVER_WAKE_MSEC : timeout_ms));
+}
+
+// the receiver thread: wait, drain, parse, validate, age, beacon.
+// everything for the app goes through the event queue.
+void BibleSync::ReceiverThread()
+{
+    while (!receiver_stop && !shutdown_pending &&
+	   (mode != BSP_MODE_DISABLE))
+    {
+	// wake up now and then to notice being stopped.
+	WaitReadable(BSP_RECEIVER_WAKE_MSEC);
+
+	std::lock_guard<std::recursive_mutex> guard(state_lock);
+	ReceiveDrain();
+    }
+}
+
+// beacon-related tasks: others' aging and sending our beacon,
+// whichever has fallen due.
+void BibleSync::Housekeeping()
+{
+    uint64_t now = now_msec();
+
+    ageSpeakers(now);
+
+    if (((mode == BSP_MODE_PERSONAL) ||
+	 (mode == BSP_MODE_SPEAKER)) &&
+	(next_beacon != 0) &&
+	(now >= next_beacon))
+    {
+	TransmitInternal(BSP_BEACON);
+	next_beacon = now + beacon_msec;
+    }
+
+    Reschedule();
+}
+
+// next Housekeeping(): our beacon, or the wheel's next busy tick.
+void BibleSync::Reschedule(void)
+{
+    uint64_t wheel_due = WheelNext();
+
+    next_tick = next_beacon;
+    if ((wheel_due != 0) && ((next_tick == 0) || (wheel_due < next_tick)))
+	next_tick = wheel_due;
+}
+
+// timed beacons: the interval applies from our next beacon on.
+void BibleSync::setBeaconInterval(unsigned int msec)
+{
+    std::lock_guard<std::recursive_mutex> guard(state_lock);
+
+    if (msec > BSP_BEACON_MSEC_MAX) msec = BSP_BEACON_MSEC_MAX;
+    if (msec < BSP_BEACON_MSEC_MIN) msec = BSP_BEACON_MSEC_MIN;
+    beacon_msec = msec;
+    if (speaker_timeout < beacon_msec)
+	speaker_timeout = beacon_msec;
+
+    if ((next_beacon != 0) && (next_beacon > now_msec() + beacon_msec))
+    {
+	next_beacon = now_msec() + beacon_msec;
+	Reschedule();
+    }
+}
+
+// speaker timeout: applies as each speaker's next beacon is heard.
+void BibleSync::setSpeakerTimeout(unsigned int msec)
+{
+    std::lock_guard<std::recursive_mutex> guard(state_lock);
+
+    if (msec > BSP_SPEAKER_TIMEOUT_MAX) msec = BSP_SPEAKER_TIMEOUT_MAX;
+    if (msec < beacon_msec)             msec = beacon_msec;
+
+    // timers are only ever found early, never late: on shortening,
+    // pull in deadlines and re-make the wheel.
+    if ((msec < speaker_timeout) && (speaker_count != 0))
+    {
+	uint64_t limit = now_msec() + msec;
+
+	for (int level = 0; level < BSP_WHEEL_LEVELS; ++level)
+	    for (int slot = 0; slot < BSP_WHEEL_SLOTS; ++slot)
+		wheel[level][slot].clear();
+	for (BibleSyncSpeaker &speaker : speakers)
+	{
+	    if (!speaker.used)
+		continue;
+	    BibleSyncTimer timer;
+	    memcpy((void *)&timer.uuid, (const void *)&speaker.uuid,
+		   sizeof(uuid_t));
+	    timer.serial = speaker.serial;
+	    speaker.deadline = min(speaker.deadline, limit);
+	    WheelInsert(timer, speaker.deadline);
+	}
+    }
+    speaker_timeout = msec;
+}
+
+// how long until Housekeeping() is due, in msec.
+// -1 when there is nothing to age and no beacon to send.
+int BibleSync::getReceiveTimeout(void)
+{
+    std::lock_guard<std::recursive_mutex> guard(state_lock);
+
+    if (mode == BSP_MODE_DISABLE)
+	return -1;
+
+    // the receiver thread keeps its own time; the app wants only events.
+    if (receiver.joinable() && !OnReceiverThread())
+	return (((queue_head.load() != queue_tail.load()) || shutdown_pending)
+		? 0 : -1);
+
+    if (budget.next < budget.held)
+	return 0;			// left by the last budget.
+
+    uint64_t now = now_msec();
+    uint64_t due = next_tick;
+    uint64_t flush = CoalesceDue();
+    if ((flush != 0) && ((due == 0) || (flush < due)))
+	due = flush;
+    flush = ErrorsDue();
+    if ((flush != 0) && ((due == 0) || (flush < due)))
+	due = flush;
+    if (due == 0)
+	return -1;
+    return ((now >= due) ? 0 : (int)(due - now));
+}
+
+// block until the socket is readable, timeout_ms passes,
+// or housekeeping is due, whichever comes first.
+void BibleSync::WaitReadable(int timeout_ms)
+{
+    int due = getReceiveTimeout();
+
+    if ((timeout_ms < 0) || ((due >= 0) && (due < timeout_ms)))
+	timeout_ms = due;
+
+#ifndef WIN32
+    struct pollfd pfd;
+    pfd.fd = server_fd;
+    pfd.events = POLLIN;
+    pfd.revents = 0;
+    (void)poll(&pfd, 1, timeout_ms);
+#else
+    fd_set read_set;
+    struct timeval tv = { timeout_ms / 1000, (timeout_ms % 1000) * 1000 };
+    FD_ZERO(&read_set);
+    FD_SET(server_fd, &read_set);
+    (void)select(server_fd+1, &read_set, NULL, NULL,
+		 ((timeout_ms < 0) ? NULL : &tv));
+#endif /* WIN32 */
+    // errors are found by the read that follows.
+}
+
+// validate, parse, and deliver a single received packet.
+void BibleSync::ReceivePacket(BibleSyncMessage &bsp,
+			      int recv_size,
+			      struct sockaddr_in &source)
+{
+    BibleSyncReceived message;
+
+    // what the last packet left in the arena is done with.
+    ArenaReset();
+
+    // the dump is rendered from here only if someone asks for it.
+    dump_packet = &bsp;
+    dump_body = bsp.body;
+    dump_source = &source;
+    dump_size = recv_size;
+
+    CountReceived(bsp, recv_size);
+
+    // our own fragments come back too: not worth reassembling.
+    if ((recv_size >= BSP_HEADER_SIZE) &&
+	(bsp.num_packets > 1) &&
+	(memcmp((const void *)&bsp.uuid, (const void *)&uuid,
+		sizeof(uuid_t)) == 0))
+    {
+	Count(BSP_STAT_ECHO);
+	return;
+    }
+
+    bool own = ((recv_size >= BSP_HEADER_SIZE) &&
+		(memcmp((const void *)&bsp.uuid, (const void *)&uuid,
+			sizeof(uuid_t)) == 0));
+    BibleSync_stat reject = CheckPacket(bsp, recv_size, source, own,
+					inbound, stats, message);
+    if (reject == BSP_STAT_FRAGMENTS)
+	return;				// held for the rest.
+    if (reject == BSP_STAT_RATE_LIMITED)
+    {
+	Count(reject);			// quietly: a flood of 'E' is no better.
+	return;
+    }
+
+    // a reassembled message is dumped whole.
+    dump_packet = message.header;
+    dump_body = message.body;
+    dump_size = BSP_HEADER_SIZE + message.length;
+
+    if (reject != N_BSP_STAT)
+    {
+	Count(reject);
+	RejectPacket(reject, *message.header, message.fields, source);
+    }
+    else
+	AcceptPacket(*message.header, message.fields, source);
+}
+
+// header sanity, reassembly and body parse, needing no session context.
+// returns N_BSP_STAT for a good message, BSP_STAT_FRAGMENTS for part
+// of one still incomplete, else the failure's counter.  message has
+// what is known of the packet, or of the whole message it completed.
+// own says the packet bears our uuid: our multicast looped back.
+BibleSync_stat BibleSync::CheckPacket(BibleSyncMessage &bsp,
+				      int recv_size,
+				      const struct sockaddr_in &source,
+				      bool own,
+				      BibleSyncInbound &in,
+				      std::atomic<uint64_t> *stats,
+				      BibleSyncReceived &message)
+{
+    BibleSyncReassembly &r = in.reassembly;
+
+    message.header = &bsp;
+    message.body = bsp.body;
+    message.length = max(recv_size - BSP_HEADER_SIZE, 0);
+    message.fields.present = 0;
+
+    if (recv_size < BSP_HEADER_SIZE)
+	return BSP_STAT_BAD_SIZE;
+
+    ((char*)&bsp)[recv_size] = '\0';	// as an ordinary C string
+
+    // validate message: fixed values.
+    if (bsp.magic != BSP_MAGIC)
+	return BSP_STAT_BAD_MAGIC;
+    // we are fine with previous v2 protocol that lacks chat messages.
+    if ((bsp.version != BSP_PROTOCOL) && (bsp.version != BSP_OLD_PROTOCOL))
+	return BSP_STAT_BAD_VERSION;
+    if ((bsp.msg_type != BSP_ANNOUNCE) &&
+	(bsp.msg_type != BSP_SYNC) &&
+	(bsp.msg_type != BSP_BEACON) &&
+	(bsp.msg_type != BSP_CHAT))
+	return BSP_STAT_BAD_TYPE;
+    if ((bsp.num_packets < 1) || (bsp.num_packets > BSP_FRAGMENTS_MAX) ||
+	(bsp.index_packet >= bsp.num_packets))
+	return BSP_STAT_BAD_COUNT;
+
+    // a sender over its allowance costs no more than this.
+    // our own echo is never charged, lest it crowd out our host's peers.
+    if (!own && ((in.by_uuid.rate != 0) || (in.by_source.rate != 0)))
+    {
+	uint64_t key[2];
+	uint64_t now = now_msec();
+
+	memcpy((void *)key, (const void *)&bsp.uuid, sizeof(key));
+	if (!Admit(in.by_source, source.sin_addr.s_addr, now) ||
+	    !Admit(in.by_uuid, key[0] ^ key[1], now))
+	    return BSP_STAT_RATE_LIMITED;
+    }
+
+    // what this sender can decode.
+    PeerHeard(in.peers, bsp);
+
+    // a fragment: nothing more until the message is whole.
+    if (bsp.num_packets > 1)
+    {
+	stats[BSP_STAT_FRAGMENTS].fetch_add(1, std::memory_order_relaxed);
+	bool whole = Reassemble(r, bsp, recv_size, source, now_msec());
+	stats[BSP_STAT_FRAGMENTS_DROPPED].fetch_add(r.dropped,
+						    std::memory_order_relaxed);
+	r.dropped = 0;
+	if (!whole)
+	    return BSP_STAT_FRAGMENTS;
+
+	stats[BSP_STAT_REASSEMBLED].fetch_add(1, std::memory_order_relaxed);
+	message.header = &r.header;
+	message.body = r.whole.data();
+	message.length = r.length;
+    }
+
+    // basic header sanity tests passed.  now parse body content.
+    if (!ParseEncoded(*message.header, message.body, message.length,
+		      message.fields, message.uuid_text))
+	return BSP_STAT_BAD_BODY;
+
+    // verify minimum body content.
+    if (inbound_required[bsp.msg_type] & ~message.fields.present)
+	return BSP_STAT_MISSING_HEADER;
+
+    return N_BSP_STAT;
+}
+
+// one more fragment toward a whole message.  true, with r.header,
+// r.whole and r.length made, when this one completes it.
+// fragments late, duplicated or inconsistent with their fellows are
+// dropped, as are a sender's oldest or everyone's oldest partial
+// messages when their bounds are reached.  r.dropped counts them.
+bool BibleSync::Reassemble(BibleSyncReassembly &r,
+			   const BibleSyncMessage &bsp,
+			   int recv_size,
+			   const struct sockaddr_in &source,
+			   uint64_t now)
+{
+    int length = recv_size - BSP_HEADER_SIZE;
+    uint16_t id;
+    int sender = 0, match = -1, oldest = -1;
+
+    memcpy((void *)&id, (const void *)bsp.reserved, sizeof(id));
+
+    // late ones go first: their memory is wanted.
+    for (size_t i = 0; i < r.partial.size(); )
+    {
+	if (r.partial[i].deadline <= now)
+	    DropPartial(r, i);
+	else
+	    ++i;
+    }
+
+    // every fragment but the last is full.
+    if ((bsp.index_packet + 1 < bsp.num_packets) &&
+	(length != BSP_MAX_PAYLOAD))
+    {
+	++r.dropped;
+	return false;
+    }
+
+    for (size_t i = 0; i < r.partial.size(); ++i)
+    {
+	BibleSyncPartial &p = r.partial[i];
+
+	if (p.addr.s_addr != source.sin_addr.s_addr)
+	    continue;
+	++sender;
+	if ((oldest < 0) || (p.deadline < r.partial[oldest].deadline))
+	    oldest = i;
+	if ((p.id == id) &&
+	    (memcmp((const void *)&p.header.uuid, (const void *)&bsp.uuid,
+		    sizeof(uuid_t)) == 0))
+	    match = i;
+    }
+
+    if (match >= 0)
+    {
+	BibleSyncPartial &p = r.partial[match];
+
+	// not what was begun: neither is any use.
+	if ((p.total != bsp.num_packets) ||
+	    (p.header.msg_type != bsp.msg_type))
+	{
+	    DropPartial(r, match);
+	    ++r.dropped;
+	    return false;
+	}
+	if (p.seen & (1U << bsp.index_packet))
+	{
+	    ++r.dropped;		// duplicate.
+	    return false;
+	}
+    }
+    else
+    {
+	size_t need = bsp.num_packets * BSP_MAX_PAYLOAD + 1;
+
+	// a sender's oldest gives way to its newest...
+	if (sender >= BSP_REASSEMBLY_SENDER)
+	    DropPartial(r, oldest);
+
+	// ...and everyone's oldest to anyone's, within the memory cap.
+	while (!r.partial.empty() && (r.bytes + need > BSP_REASSEMBLY_BYTES))
+	{
+	    oldest = 0;
+	    for (size_t i = 1; i < r.partial.size(); ++i)
+		if (r.partial[i].deadline < r.partial[oldest].deadline)
+		    oldest = i;
+	    DropPartial(r, oldest);
+	}
+
+	match = r.partial.size();
+	r.partial.emplace_back();
+	BibleSyncPartial &p = r.partial.back();
+	memcpy((void *)&p.header, (const void *)&bsp, BSP_HEADER_SIZE);
+	p.addr = source.sin_addr;
+	p.id = id;
+	p.total = bsp.num_packets;
+	p.seen = 0;
+	p.length = 0;
+	p.deadline = now + BSP_REASSEMBLY_MSEC;
+	p.body.resize(need);
+	r.bytes += need;
+    }
+
+    BibleSyncPartial &p = r.partial[match];
+    memcpy(&p.body[bsp.index_packet * BSP_MAX_PAYLOAD], bsp.body, length);
+    p.seen |= (1U << bsp.index_packet);
+    if (bsp.index_packet + 1 == bsp.num_packets)
+	p.length = bsp.index_packet * BSP_MAX_PAYLOAD + length;
+
+    if (p.seen != ((1U << p.total) - 1))
+	return false;
+
+    // whole: hand it over, as an ordinary C string.
+    memcpy((void *)&r.header, (const void *)&p.header, BSP_HEADER_SIZE);
+    r.whole.swap(p.body);
+    r.length = p.length;
+    r.whole[r.length] = '\0';
+    r.bytes -= r.whole.size();
+    r.partial[match] = std::move(r.partial.back());
+    r.partial.pop_back();
+    return true;
+}
+
+// forget a partial message, counting the fragments it had.
+void BibleSync::DropPartial(BibleSyncReassembly &r, size_t i)
+{
+    for (uint32_t seen = r.partial[i].seen; seen != 0; seen &= seen - 1)
+	++r.dropped;
+    r.bytes -= r.partial[i].body.size();
+    if (i + 1 != r.partial.size())
+	r.partial[i] = std::move(r.partial.back());
+    r.partial.pop_back();
+}
+
+// tell the app why CheckPacket() refused a packet.
+void BibleSync::RejectPacket(BibleSync_stat reject,
+			     const BibleSyncMessage &bsp,
+			     const BibleSyncFields &fields,
+			     const struct sockaddr_in &source)
+{
+    BibleSync_error why;
+
+    switch (reject)
+    {
+    case BSP_STAT_BAD_SIZE:	why = BSP_ERROR_BAD_SIZE;		break;
+    case BSP_STAT_BAD_MAGIC:	why = BSP_ERROR_BAD_MAGIC;		break;
+    case BSP_STAT_BAD_VERSION:	why = BSP_ERROR_BAD_VERSION;		break;
+    case BSP_STAT_BAD_TYPE:	why = BSP_ERROR_BAD_TYPE;		break;
+    case BSP_STAT_BAD_COUNT:
+	why = (((bsp.num_packets < 1) || (bsp.num_packets > BSP_FRAGMENTS_MAX))
+	       ? BSP_ERROR_BAD_COUNT
+	       : BSP_ERROR_BAD_INDEX);
+	break;
+    case BSP_STAT_BAD_BODY:	why = BSP_ERROR_BAD_BODY;		break;
+
+    default:
+	// don't stop at one -- report all missing.
+	uint32_t missing = (inbound_required[bsp.msg_type]
+			    & ~fields.present);
+	for (int i = 0; missing != 0; ++i, missing >>= 1)
+	{
+	    if (missing & 1)
+		ReportError(BSP_ERROR_MISSING_HEADER, field_names[i].name,
+			    &source);
+	}
+	return;
+    }
+
+    ReportError(why, EMPTY, &source);
+}
+
+// a valid packet, in this session's context:
+// speakers, spoofs, echoes, passphrase, mode.
+void BibleSync::AcceptPacket(const BibleSyncMessage &bsp,
+			     const BibleSyncFields &fields,
+			     struct sockaddr_in &source)
+{
+    // find listening status for this guy, by header uuid.
+    // printable key and address are made only for delivery.
+    BibleSyncSpeaker *speaker = FindSpeaker(bsp.uuid);
+    char pkt_uuid[BSP_UUID_PRINT_LENGTH];
+    char source_addr[INET_ADDRSTRLEN];
+    bool listening;
+
+    // spoof & listen check:
+    if (speaker != NULL)
+    {
+	// is some legit xmitter's UUID being borrowed?
+	if (speaker->addr.s_addr != source.sin_addr.s_addr)	// spoof?
+	{
+	    // spock: "forbid...forbid!"
+	    Count(BSP_STAT_SPOOF);
+	    uuid_dump(bsp.uuid, pkt_uuid);
+	    strcpy(source_addr, inet_ntoa(speaker->addr));
+	    Deliver('M', &bsp.uuid, pkt_uuid,
+		    EMPTY, EMPTY, EMPTY, EMPTY, EMPTY,
+		    Compose({ bsp_text, _("Spoof stopped: "), pkt_uuid,
+			      " from ", inet_ntoa(source.sin_addr),
+			      " instead of ", source_addr }));
+	    return;
+	}
+	listening = speaker->listen;
+    }
+    else
+    {
+	listening = false;	// not in map => ignore.
+    }
+
+    // loopback is enabled: reject self-uuid packets.
+    unsigned int i;
+    unsigned char *incoming = (unsigned char *)&uuid;
+    unsigned char *mine     = (unsigned char *)&bsp.uuid;
+    for (i = 0; i < sizeof(uuid_t); ++i)
+    {
+	if (incoming[i] != mine[i])
+	    break;	// not ourselves.
+    }
+    // if we end the loop without early break,
+    // then we matched UUID for ourselves.
+    // i.e. we're hearing an echo of ourselves.  ignore.
+    if (i == sizeof(uuid_t))
+    {
+	Count(BSP_STAT_ECHO);
+#if 0
+	Deliver('E', &bsp.uuid, pkt_uuid,
+		EMPTY, EMPTY, EMPTY, EMPTY, EMPTY,
+		BSP + _("Ignoring echo."));
+#endif
+	return;
+    }
+
+    // a known speaker's beacon only restarts its aging countdown.
+    // it is by far the most common traffic: nothing for the app.
+    if ((bsp.msg_type == BSP_BEACON) &&
+	(speaker != NULL) &&
+	(passphrase == fields.value[BSP_FIELD_MSG_PASSPHRASE]))
+    {
+	speaker->deadline = now_msec() + speaker_timeout;
+	return;
+    }
+
+    uuid_dump(bsp.uuid, pkt_uuid);
+    strcpy(source_addr, inet_ntoa(source.sin_addr));
+
+    // give reference items initial filler content.
+    // these are views, into the packet where possible;
+    // text that must be composed is in the arena.
+    string_view bible = "<>", ref = "<>", alt = "<>",
+	group = "<>", domain = "<>",
+	info = "<>";
+    char cmd;
+
+    string_view version = fields.value[BSP_FIELD_APP_VERSION];
+    if (version == "")
+	version = "(version?)";
+
+    // generally good, so extract interesting content.
+    if (bsp.msg_type == BSP_CHAT)
+    {
+	bible  = fields.value[BSP_FIELD_APP_USER];
+	ref    = source_addr;
+	group  = Compose({ fields.value[BSP_FIELD_APP_NAME], " ", version });
+	if (fields.present & BSP_FIELD_BIT(BSP_FIELD_APP_DEVICE))
+	    domain = fields.value[BSP_FIELD_APP_DEVICE];
+	alt    = fields.value[BSP_FIELD_MSG_CHAT];
+
+	info   = Compose({ "chat: ", fields.value[BSP_FIELD_APP_USER],
+			   " @ ", source_addr });
+
+	cmd = ((passphrase ==
+		fields.value[BSP_FIELD_MSG_PASSPHRASE])
+	       ? 'C'	// chat message
+	       : 'M');	// mismatch
+    }
+    else if (bsp.msg_type == BSP_SYNC)
+    {
+	// regular synchronized navigation
+	bible  = fields.value[BSP_FIELD_MSG_SYNC_BIBLEABBREV];
+	ref    = fields.value[BSP_FIELD_MSG_SYNC_VERSE];
+	if (fields.present & BSP_FIELD_BIT(BSP_FIELD_MSG_SYNC_ALTVERSE))
+	    alt = fields.value[BSP_FIELD_MSG_SYNC_ALTVERSE];
+	group  = fields.value[BSP_FIELD_MSG_SYNC_GROUP];
+	domain = fields.value[BSP_FIELD_MSG_SYNC_DOMAIN];
+
+	if (domain != "BIBLE-VERSE")
+	{
+	    ReportError(BSP_ERROR_BAD_DOMAIN, domain, &source,
+			&bsp.uuid, pkt_uuid,
+			bible, ref, alt, group, domain);
+	    return;
+	} else if ((group.length() != 1) ||
+		   (group[0] < '1') ||
+		   (group[0] > '9'))
+	{
+	    ReportError(BSP_ERROR_BAD_GROUP, group, &source,
+			&bsp.uuid, pkt_uuid,
+			bible, ref, alt, group, domain);
+	    return;
+	}
+	else if (((mode == BSP_MODE_PERSONAL) ||  // (receiver ||
+		  (mode == BSP_MODE_AUDIENCE)) && //  receiver) &&
+		 listening &&			  // being heard &&
+		 (passphrase ==			  // match
+		  fields.value[BSP_FIELD_MSG_PASSPHRASE]))
+	{
+	    cmd = 'N';	// navigation
+	}
+	else
+	{
+	    cmd = 'M';	// mismatch
+	    info = Compose({ "sync: ", fields.value[BSP_FIELD_APP_USER],
+			     " @ ", source_addr });
+	}
+    }
+    else if (bsp.msg_type == BSP_ANNOUNCE)
+    {
+	// construct user's presence announcement
+	bible  = fields.value[BSP_FIELD_APP_USER];
+	ref    = source_addr;
+	group  = Compose({ fields.value[BSP_FIELD_APP_NAME], " ", version });
+	if (fields.present & BSP_FIELD_BIT(BSP_FIELD_APP_DEVICE))
+	    domain = fields.value[BSP_FIELD_APP_DEVICE];
+
+	alt    = Compose({ bsp_text, fields.value[BSP_FIELD_APP_USER],
+			   translated(TEXT_PRESENT_AT), source_addr,
+			   translated(TEXT_USING), group, "." });
+
+	info   = Compose({ "announce: ", fields.value[BSP_FIELD_APP_USER],
+			   " @ ", source_addr });
+
+	cmd = ((passphrase ==
+		fields.value[BSP_FIELD_MSG_PASSPHRASE])
+	       ? 'A'	// presence announcement
+	       : 'M');	// mismatch
+    }
+    else // bsp.msg_type == BSP_BEACON
+    {
+	bible  = fields.value[BSP_FIELD_APP_USER];
+	ref    = source_addr;
+	group  = Compose({ fields.value[BSP_FIELD_APP_NAME], " ", version });
+	if (fields.present & BSP_FIELD_BIT(BSP_FIELD_APP_DEVICE))
+	    domain = fields.value[BSP_FIELD_APP_DEVICE];
+
+	info   = Compose({ "beacon: ", fields.value[BSP_FIELD_APP_USER],
+			   " @ ", source_addr });
+
+	if (passphrase ==
+	    fields.value[BSP_FIELD_MSG_PASSPHRASE])
+	{
+	    // known speakers were handled above.
+	    cmd = 'S';	// unknown: potential speaker.
+
+	    // listen to 1st speaker, ignore everyone else.
+	    // the app can make other choices.
+	    // speaker listens to no one.
+	    bool first = (speaker_count == 0);
+
+	    // a beacon starts the aging countdown.
+	    BibleSyncSpeaker &fresh = AddSpeaker(bsp.uuid);
+	    Count(BSP_STAT_SPEAKERS_ADDED);
+	    BibleSyncTimer timer;
+	    uint64_t now = now_msec();
+
+	    // an idle wheel does not keep up with the clock.
+	    if (speaker_count == 1)
+		wheel_now = max(wheel_now, now / BSP_WHEEL_MSEC);
+
+	    fresh.deadline = now + speaker_timeout;
+	    fresh.serial = timer.serial = ++speaker_serial;
+	    memcpy((void *)&timer.uuid, (const void *)&bsp.uuid,
+		   sizeof(uuid_t));
+	    WheelInsert(timer, fresh.deadline);
+
+	    // record address for first-time-seen beacon,
+	    // for anti-spoof checks in the future.
+	    fresh.addr = source.sin_addr;
+
+	    fresh.listen = ((mode != BSP_MODE_SPEAKER) && first);
+	}
+	else
+	{
+	    cmd = 'M';		// mismatch.
+	}
+    }
+
+    // delivery to application.
+    Deliver(cmd, &bsp.uuid, pkt_uuid,
+	    bible, ref, alt, group, domain,
+	    info, true);		// re-xmit lock.
+}
+
+// batched network read access.
+// returns the count acquired, at most want.
+int BibleSync::ReceiveBatch(int want)
+{
+    const char *failure;
+
+    // nothing read yet: no dump available for errors here.
+    dump_packet = NULL;
+    dump_source = NULL;
+    dump_size = 0;
+
+    int recv_count = ReadBatch(server_fd, recv_buffer, recv_source,
+			       recv_length, failure, want);
+    if (recv_count < 0)
+	ReportError(BSP_ERROR_RECEIVE, failure, NULL);
+    return recv_count;
+}
+
+// on linux, one non-blocking recvmmsg(2) collects as many waiting
+// packets as will fit, up to want, at most BSP_RECV_BATCH.  elsewhere,
+// or if the kernel lacks recvmmsg(2), no-wait select and recvfrom
+// collect one.
+// returns the count acquired, or -1 with failure naming the call.
+int BibleSync::ReadBatch(int fd,
+			 BibleSyncMessage *buffer,
+			 struct sockaddr_in *source,
+			 int *length,
+			 const char *&failure,
+			 int want)
+{
+#ifdef linux
+    struct mmsghdr msgs[BSP_RECV_BATCH];
+    struct iovec iov[BSP_RECV_BATCH];
+
+    memset((void *)msgs, 0, sizeof(msgs));
+    for (int i = 0; i < BSP_RECV_BATCH; ++i)
+    {
+	iov[i].iov_base = (void *)&buffer[i];
+	iov[i].iov_len = BSP_MAX_SIZE;
+	msgs[i].msg_hdr.msg_name = (void *)&source[i];
+	msgs[i].msg_hdr.msg_namelen = sizeof(source[i]);
+	msgs[i].msg_hdr.msg_iov = &iov[i];
+	msgs[i].msg_hdr.msg_iovlen = 1;
+    }
+
+    int recv_count = recvmmsg(fd, msgs, want,
+			      MSG_DONTWAIT, NULL);
+    if (recv_count < 0)
+    {
+	if ((errno == EAGAIN) || (errno == EWOULDBLOCK) || (errno == EINTR))
+	    return 0;			// nothing waiting.
+
+	if (errno != ENOSYS)
+	{
+	    failure = "recvmmsg < 0";
+	    return -1;
+	}
+	// no recvmmsg(2) here after all: fall through to the old way.
+    }
+    else
+    {
+	for (int i = 0; i < recv_count; ++i)
+	    length[i] = msgs[i].msg_len;
+	return recv_count;
+    }
+#endif /* linux */
+
+    struct timeval tv = { 0, 0 };	// select returns immediately
+    fd_set read_set;
+#ifndef WIN32
+    // yes, really:
+    // linux insists on unsigned int, win32 insists on int.
+    // each complains bitterly of invalid conversion if wrongly used.
+    unsigned
+#endif
+    int source_length = sizeof(*source);
+
+    FD_ZERO(&read_set);
+    FD_SET(fd, &read_set);
+    if (select(fd+1, &read_set, NULL, NULL, &tv) < 0)
+    {
+	failure = "select < 0";
+	return -1;
+    }
+
+    if (!FD_ISSET(fd, &read_set))
+	return 0;
+
+    if ((length[0] = recvfrom(fd, (char *)buffer, BSP_MAX_SIZE,
+			      0, (sockaddr *)source,
+			      &source_length)) < 0)
+    {
+	failure = "recvfrom < 0";
+	return -1;
+    }
+    return ((length[0] > 0) ? 1 : 0);
+}
+
+// speaker transmitter
+// sanity checks for permission to xmit,
+// then format and ship it.
+BibleSync_xmit_status
+BibleSync::TransmitInternal(char message_type,
+			    string_view bible,
+			    string_view ref,
+			    string_view alt,
+			    string_view group,
+			    string_view domain)
+{
+    std::lock_guard<std::recursive_mutex> guard(state_lock);
+
+    BibleSync_xmit_status retval = TransmitCheck(message_type);
+    if (retval != BSP_XMIT_OK)
+	return retval;
+
+    BibleSyncGather gather;
+    BibleSyncPacket packet[BSP_FRAGMENTS_MAX];
+    Gather(gather, message_type, bible, ref, alt, group, domain);
+
+    int count = Fragment(gather, packet);
+    int sent = ((count == 1)
+		? (SendGather(packet[0].iov, packet[0].count) ? 1 : 0)
+		: SendPackets(packet, count));
+    if ((sent < count) && TransmitRecover())
+	sent += SendPackets(packet + sent, count - sent);
+    for (int i = 0; i < sent; ++i)
+	CountSent(packet[i]);
+    if (sent < count)
+    {
+	retval = BSP_XMIT_FAILED;
+	TransmitFailed();
+    }
+    return retval;
+}
+
+// batched speaker transmitter.
+// each record is checked as Transmit() or Chat() would be, and
+// its status left in status[].  all that pass go out together:
+// on linux, by one sendmmsg(2) per BSP_XMIT_BATCH packets.
+// a long message's fragments all go in the same batch.
+// returns how many were sent.
+int BibleSync::TransmitBatch(const BibleSync_xmit_record *record,
+			     int count,
+			     BibleSync_xmit_status *status)
+{
+    std::lock_guard<std::recursive_mutex> guard(state_lock);
+    BibleSyncPacket packet[BSP_XMIT_BATCH];
+    int index[BSP_XMIT_BATCH];		// record of each gather...
+    int last[BSP_XMIT_BATCH];		// ...and packets through its own.
+    int sent = 0;
+    int i = 0;
+
+    // room for a long chat in each: made once, not per call.
+    if (xmit_batch.size() < BSP_XMIT_BATCH)
+	xmit_batch.resize(BSP_XMIT_BATCH);
+
+    while (i < count)
+    {
+	int ready = 0, packets = 0;
+
+	for ( ; i < count; ++i)
+	{
+	    const BibleSync_xmit_record &r = record[i];
+	    char message_type = (r.chat ? BSP_CHAT : BSP_SYNC);
+	    BibleSyncGather &gather = xmit_batch[ready];
+
+	    status[i] = TransmitCheck(message_type);
+	    if (status[i] != BSP_XMIT_OK)
+		continue;
+
+	    if (r.chat)
+		Gather(gather, BSP_CHAT, r.message);
+	    else
+		Gather(gather, BSP_SYNC,
+		       r.bible, r.ref, r.alt, r.group, r.domain);
+
+	    // no room for all its fragments: it starts the next batch.
+	    if (packets + BSP_FRAGMENTS(gather.length) > BSP_XMIT_BATCH)
+		break;
+
+	    // sent now: anything held for its group is stale.
+	    if (!r.chat && !pending.empty())
+	    {
+		auto held = pending.find(r.group);
+		if (held != pending.end())
+		    pending.erase(held);
+	    }
+	    packets += Fragment(gather, packet + packets);
+	    index[ready] = i;
+	    last[ready++] = packets;
+	}
+
+	int done = SendPackets(packet, packets);
+	if ((done < packets) && TransmitRecover())
+	    done += SendPackets(packet + done, packets - done);
+	for (int p = 0; p < done; ++p)
+	    CountSent(packet[p]);
+	for (int g = 0; g < ready; ++g)
+	{
+	    if (last[g] <= done)
+		++sent;
+	    else
+		status[index[g]] = BSP_XMIT_FAILED;
+	}
+	if (done < packets)
+	{
+	    for ( ; i < count; ++i)
+		status[i] = BSP_XMIT_FAILED;
+	    TransmitFailed();
+	}
+    }
+    return sent;
+}
+
+// permission to xmit this type now.
+BibleSync_xmit_status BibleSync::TransmitCheck(char message_type)
+{
+    if (mode == BSP_MODE_DISABLE)
+	return BSP_XMIT_FAILED;
+
+    if ((message_type == BSP_SYNC) && receiving)
+	return BSP_XMIT_RECEIVING;	// if this occurs, app re-xmit'd. *NO*.
+
+    if (client_fd < 0)
+	return BSP_XMIT_NO_SOCKET;
+
+    if ((message_type != BSP_ANNOUNCE) &&
+	(message_type != BSP_SYNC) &&
+	(message_type != BSP_BEACON) &&
+	(message_type != BSP_CHAT))
+	return BSP_XMIT_BAD_TYPE;
+
+    if ((mode == BSP_MODE_AUDIENCE) &&
+	((message_type == BSP_SYNC) || (message_type == BSP_BEACON)))
+	return BSP_XMIT_NO_AUDIENCE_XMIT;
+
+    return BSP_XMIT_OK;
+}
+
+// statistics for one packet sent.
+void BibleSync::CountSent(const BibleSyncPacket &packet)
+{
+    uint8_t type = packet.header[offsetof(BibleSyncMessage, msg_type)];
+    uint64_t bytes = 0;
+
+    for (int i = 0; i < packet.count; ++i)
+	bytes += packet.iov[i].iov_len;
+    Count((BibleSync_stat)(BSP_STAT_SENT_ANNOUNCE + type - BSP_ANNOUNCE));
+    Count(BSP_STAT_SENT_BYTES, bytes);
+}
+
+// a failed send: the network may have moved under us, with netlink's
+// news of it not yet read.  follow it in place, now, and say whether
+// the send is worth one more try.
+bool BibleSync::TransmitRecover(void)
+{
+    if (recovering || (client_fd < 0))
+	return false;
+
+    recovering = true;
+    InterfaceLost();
+    bool retry = MoveInterface();
+    recovering = false;
+    return retry;
+}
+
+// a failed send, even once the interface was followed: the network
+// is gone.
+void BibleSync::TransmitFailed(void)
+{
+    Count(BSP_STAT_SEND_FAILED);
+    InterfaceLost();
+    ReportError(BSP_ERROR_TRANSMIT, EMPTY, NULL, NULL,
+		EMPTY, EMPTY, EMPTY, EMPTY, EMPTY, EMPTY,
+		_("Unable to multicast; BibleSync is now disabled. "
+		  "If your network connection changed while this program "
+		  "was active, it may be sufficient to re-enable."));
+    // with a receiver thread, the shutdown must wait for Receive().
+    if (receiver.joinable())
+    {
+	shutdown_pending = true;
+	Wake();
+    }
+    else
+	Shutdown();
+}
+
+// lay out one packet as pieces: header, pre-encoded identity,
+// then content as name=, value, newline, gathered from where it lies.
+// (chat overloads bible.)
+void BibleSync::Gather(BibleSyncGather &gather,
+		       char message_type,
+		       string_view bible,
+		       string_view ref,
+		       string_view alt,
+		       string_view group,
+		       string_view domain)
+{
+    if (xmit_prefix.empty())
+	BuildTransmitPrefix();
+
+    // header: only the type varies, and the body's encoding.
+    memcpy(gather.header, xmit_header, BSP_HEADER_SIZE);
+    gather.header[offsetof(BibleSyncMessage, msg_type)] = message_type;
+
+    if (message_type == BSP_CHAT)
+    {
+	// innoculate chat content against internal \n.
+	if (memchr(bible.data(), '\n', bible.length()) != NULL)
+	{
+	    size_t length = min(bible.length(), sizeof(gather.chat));
+	    for (size_t i = 0; i < length; ++i)
+		gather.chat[i] = ((bible[i] == '\n') ? '\t' : bible[i]);
+	    bible = string_view(gather.chat, length);
+	}
+    }
+
+    string_view value[] = { bible, domain, group, alt, ref };
+    int fields = ((message_type == BSP_CHAT) ? 1
+		  : (message_type == BSP_SYNC)
+		  ? BSP_FIELDS_XMIT_SYNC - BSP_FIELDS_XMIT_ANNOUNCE
+		  : 0);
+
+    // navigation and chat go as TLV or compressed if allowed, and if
+    // every peer can read them; presence and beacons never do, so all
+    // hear them.
+    uint8_t encoding = BSP_BODY_TEXT;
+    string_view token[sizeof(value) / sizeof(value[0])];
+
+    // longer than a packet only if every peer can put it back together.
+    size_t limit = (PeersCapable(Peers(), BSP_CAP_FRAGMENTS)
+		    ? BSP_MAX_MESSAGE : BSP_MAX_PAYLOAD);
+
+    if ((fields > 0) && tlv && !xmit_tlv.empty() &&
+	(xmit_tlv.length() < limit - 1) &&
+	PeersCapable(Peers(), BSP_CAP_TLV))
+	encoding = BSP_BODY_TLV;
+    else if ((fields > 0) && compress && !xmit_compressed.empty() &&
+	     PeersCapable(Peers(), BSP_CAP_COMPRESSED))
+    {
+	encoding = BSP_BODY_COMPRESSED;
+	for (int i = 0; i < fields; ++i)
+	{
+	    token[i] = value[i];
+	    if (!compress_value(token[i]))
+	    {
+		encoding = BSP_BODY_TEXT;
+		break;
+	    }
+	}
+    }
+    gather.header[offsetof(BibleSyncMessage, reserved) + BSP_RES_BODY] =
+	encoding;
+
+    struct iovec *iov = gather.iov;
+    int count = 0;
+    iov[count].iov_base = gather.header;
+    iov[count++].iov_len = BSP_HEADER_SIZE;
+    const string &prefix = ((encoding == BSP_BODY_TLV) ? xmit_tlv
+			    : (encoding == BSP_BODY_COMPRESSED)
+			    ? xmit_compressed : xmit_prefix);
+    iov[count].iov_base = (void *)prefix.data();
+    iov[count++].iov_len = prefix.length();
+
+    const string_view *names = ((message_type == BSP_CHAT)
+				? ((encoding == BSP_BODY_TEXT)
+				   ? &outbound_chat : &compressed_chat)
+				: ((encoding == BSP_BODY_TEXT)
+				   ? outbound_sync : compressed_sync));
+
+    // TLV is fitted as it goes, so that nothing below cuts it short;
+    // the other encodings are cut as text.
+    if (encoding == BSP_BODY_TLV)
+	count = GatherTLV(gather, count, names, value, fields,
+			  limit - 1 - prefix.length());
+    else if (fields > 0)
+	count = GatherFields(iov, count, names,
+			     ((encoding == BSP_BODY_COMPRESSED) ? token : value),
+			     fields);
+
+    // beyond the limit, cut short but keep a final newline, to
+    // preserve body format (cuts off excessively long verse references
+    // and chat messages).  Fragment() splits whatever exceeds a packet.
+    size_t room = BSP_HEADER_SIZE + limit;
+    int i;
+
+    for (i = 0; i < count; ++i)
+    {
+	if (iov[i].iov_len >= room)
+	{
+	    iov[i].iov_len = room - 1;
+	    iov[++i].iov_base = outbound_newline;
+	    iov[i++].iov_len = 1;
+	    room = 0;
+	    break;
+	}
+	room -= iov[i].iov_len;
+    }
+    gather.count = i;
+    gather.length = limit - room;
+}
+
+// a gathered message as packets: itself, if it fits in one, else
+// fragments of exactly BSP_MAX_PAYLOAD but the last, pieces divided
+// where they must be.  returns how many.
+int BibleSync::Fragment(const BibleSyncGather &gather, BibleSyncPacket *packet)
+{
+    int total = BSP_FRAGMENTS(gather.length);
+    int piece = 1;			// past the header.
+    size_t offset = 0;			// into piece.
+
+    if (total > 1)
+	++fragment_id;
+
+    for (int f = 0; f < total; ++f)
+    {
+	BibleSyncPacket &p = packet[f];
+	BibleSyncMessage *bsp = (BibleSyncMessage *)p.header;
+	size_t room = BSP_MAX_PAYLOAD;
+
+	memcpy(p.header, gather.header, BSP_HEADER_SIZE);
+	if (total > 1)
+	{
+	    bsp->num_packets = total;
+	    bsp->index_packet = f;
+	    memcpy((void *)bsp->reserved, (const void *)&fragment_id,
+		   sizeof(fragment_id));
+	}
+	p.iov[0].iov_base = p.header;
+	p.iov[0].iov_len = BSP_HEADER_SIZE;
+	p.count = 1;
+
+	while ((room > 0) && (piece < gather.count))
+	{
+	    size_t take = min(gather.iov[piece].iov_len - offset, room);
+
+	    if (take > 0)
+	    {
+		p.iov[p.count].iov_base =
+		    (char *)gather.iov[piece].iov_base + offset;
+		p.iov[p.count++].iov_len = take;
+	    }
+	    room -= take;
+	    offset += take;
+	    if (offset == gather.iov[piece].iov_len)
+	    {
+		++piece;
+		offset = 0;
+	    }
+	}
+    }
+    return total;
+}
+
+// append name=, value, newline for each field.
+int BibleSync::GatherFields(struct iovec *iov, int count,
+			    const string_view *name,
+			    const string_view *value,
+			    int fields)
+{
+    for (int i = 0; i < fields; ++i)
+    {
+	iov[count].iov_base = (void *)name[i].data();
+	iov[count++].iov_len = name[i].length();
+	iov[count].iov_base = (void *)value[i].data();
+	iov[count++].iov_len = value[i].length();
+	iov[count].iov_base = outbound_newline;
+	iov[count++].iov_len = 1;
+    }
+    return count;
+}
+
+// content fields as TLV records: tag and length in the gather, the value
+// where it lies.  values are cut to fit room, which is what is left of
+// BSP_MAX_MESSAGE; records which cannot fit at all are left off.
+int BibleSync::GatherTLV(BibleSyncGather &gather, int count,
+			 const string_view *tag, const string_view *value,
+			 int fields, size_t room)
+{
+    for (int i = 0; (i < fields) && (room >= BSP_TLV_HEADER); ++i)
+    {
+	size_t n = min(value[i].length(), room - BSP_TLV_HEADER);
+	uint8_t *t = gather.tlv[i];
+
+	t[0] = tag[i][0];
+	t[1] = n >> 8;
+	t[2] = n & 0xff;
+	gather.iov[count].iov_base = t;
+	gather.iov[count++].iov_len = BSP_TLV_HEADER;
+	gather.iov[count].iov_base = (void *)value[i].data();
+	gather.iov[count++].iov_len = n;
+	room -= BSP_TLV_HEADER + n;
+    }
+    return count;
+}
+
+// encode what never varies between sends: header and identity.
+void BibleSync::BuildTransmitPrefix(void)
+{
+    BibleSyncMessage *bsp = (BibleSyncMessage *)xmit_header;
+
+    memset(xmit_header, 0, BSP_HEADER_SIZE);
+    bsp->magic = BSP_MAGIC;
+    bsp->version = BSP_PROTOCOL;
+    bsp->num_packets = 1;
+    bsp->index_packet = 0;
+    bsp->reserved[BSP_RES_CAPS] =
+	BSP_CAP_COMPRESSED | BSP_CAP_TLV | BSP_CAP_FRAGMENTS;
+    memcpy((void *)&bsp->uuid, (const void *)&uuid, sizeof(uuid_t));
+
+    xmit_prefix = (string)
+	BSP_APP_NAME          "=" + application + "\n" +
+	BSP_APP_VERSION       "=" + version     + "\n" +
+	BSP_APP_INSTANCE_UUID "=" + uuid_string + "\n" +
+	BSP_APP_OS            "=" BSP_OS          "\n" +
+	BSP_APP_DEVICE        "=" + device      + "\n" +
+	BSP_APP_USER          "=" + user        + "\n" +
+	BSP_MSG_PASSPHRASE    "=" + passphrase  + "\n";
+
+    // the same, compressed, if every value allows.
+    string_view os = BSP_OS;
+    string_view value[] = { application, version, os, device, user,
+			    passphrase };
+    static constexpr int field[] = {
+	BSP_FIELD_APP_NAME, BSP_FIELD_APP_VERSION, BSP_FIELD_APP_OS,
+	BSP_FIELD_APP_DEVICE, BSP_FIELD_APP_USER, BSP_FIELD_MSG_PASSPHRASE
+    };
+
+    xmit_compressed.clear();
+    for (int i = 0; i < (int)(sizeof(field) / sizeof(field[0])); ++i)
+    {
+	if (!compress_value(value[i]))
+	{
+	    xmit_compressed.clear();
+	    break;
+	}
+	xmit_compressed += name_tokens[field[i]];
+	xmit_compressed += value[i];
+	xmit_compressed += '\n';
+    }
+
+    // and as TLV, unless unreasonably long.
+    xmit_tlv.clear();
+    string_view plain[] = { application, version, os, device, user,
+			    passphrase };
+    for (int i = 0; i < (int)(sizeof(field) / sizeof(field[0])); ++i)
+    {
+	if (xmit_tlv.length() + BSP_TLV_HEADER + plain[i].length()
+	    > BSP_TLV_PREFIX_MAX)
+	{
+	    xmit_tlv.clear();
+	    break;
+	}
+	xmit_tlv += name_tokens[field[i]];
+	xmit_tlv += (char)(plain[i].length() >> 8);
+	xmit_tlv += (char)(plain[i].length() & 0xff);
+	xmit_tlv += plain[i];
+    }
+}
+
+// ship the gathered pieces as one packet.
+bool BibleSync::SendGather(struct iovec *iov, int count)
+{
+#ifndef WIN32
+    struct msghdr msg;
+    memset(&msg, 0, sizeof(msg));
+    msg.msg_name = (void *)&client;
+    msg.msg_namelen = sizeof(client);
+    msg.msg_iov = iov;
+    msg.msg_iovlen = count;
+
+    return (sendmsg(client_fd, &msg, 0) >= 0);
+#else
+    char packet[BSP_MAX_SIZE];
+    size_t length = 0;
+
+    for (int i = 0; i < count; ++i)
+    {
+	memcpy(packet + length, iov[i].iov_base, iov[i].iov_len);
+	length += iov[i].iov_len;
+    }
+    return (sendto(client_fd, packet, length, 0,
+		   (struct sockaddr *)&client, sizeof(client)) >= 0);
+#endif
+}
+
+// ship several packets, in order.
+// on linux, with sendmmsg(2); elsewhere, or if the kernel lacks
+// sendmmsg(2), one at a time.  returns how many went out before
+// any failure.
+int BibleSync::SendPackets(BibleSyncPacket *packet, int count)
+{
+    int sent = 0;
+
+#ifdef linux
+    struct mmsghdr msgs[BSP_XMIT_BATCH];
+
+    memset((void *)msgs, 0, sizeof(msgs));
+    for (int i = 0; i < count; ++i)
+    {
+	msgs[i].msg_hdr.msg_name = (void *)&client;
+	msgs[i].msg_hdr.msg_namelen = sizeof(client);
+	msgs[i].msg_hdr.msg_iov = packet[i].iov;
+	msgs[i].msg_hdr.msg_iovlen = packet[i].count;
+    }
+
+    while (sent < count)
+    {
+	int result = sendmmsg(client_fd, msgs + sent, count - sent, 0);
+	if (result < 0)
+	{
+	    if (errno == EINTR)
+		continue;
+	    if ((errno == ENOSYS) && (sent == 0))
+		break;			// no sendmmsg(2): the old way.
+	    return sent;
 	}
+	sent += result;
     }
+    if (sent == count)
+	return sent;
+#endif /* linux */
 
-    // beacon-related tasks: others' aging and sending our beacon.
-    ageSpeakers();
+    for ( ; sent < count; ++sent)
+	if (!SendGather(packet[sent].iov, packet[sent].count))
+	    break;
+    return sent;
+}
 
-    if (((mode == BSP_MODE_PERSONAL) ||
-	 (mode == BSP_MODE_SPEAKER)) &&
-	(--beacon_countdown == 0))
+// navigation to be held rather than sent, latest per group.
+// refused now for whatever would refuse it at send time.
+BibleSync_xmit_status
+BibleSync::TransmitCoalesce(string_view bible,
+			    string_view ref,
+			    string_view alt,
+			    string_view group,
+			    string_view domain)
+{
+    std::lock_guard<std::recursive_mutex> guard(state_lock);
+
+    BibleSync_xmit_status retval = TransmitCheck(BSP_SYNC);
+    if (retval != BSP_XMIT_OK)
+	return retval;
+
+    uint64_t now = now_msec();
+    auto held = pending.find(group);
+    if (held == pending.end())
     {
-	TransmitInternal(BSP_BEACON);
-	beacon_countdown = beacon_count;
+	held = pending.emplace(string(group), BibleSyncPending()).first;
+	held->second.first = now;
     }
+    held->second.bible  = bible;
+    held->second.ref    = ref;
+    held->second.alt    = alt;
+    held->second.domain = domain;
+    held->second.last   = now;
 
-    return TRUE;
+    return retval;
 }
 
-// network read access.
-// do full initialization, no-wait select, and no-wait recvfrom
-// to get potential nav data.  returns size acquired.
-// controls 'while' in ReceiveInternal().
-int BibleSync::InitSelectRead(char *dump,
-			      struct sockaddr_in *source,
-			      BibleSyncMessage *buffer)
+// send held navigation: all of it, or what is due.
+// not from within an event, where Transmit() is refused: it waits.
+void BibleSync::FlushCoalesced(bool all)
 {
-    struct timeval tv = { 0, 0 };	// select returns immediately
-    fd_set read_set;
-    int recv_size = 0;
-#ifndef WIN32
-    // yes, really:
-    // linux insists on unsigned int, win32 insists on int.
-    // each complains bitterly of invalid conversion if wrongly used.
-    unsigned
-#endif
-    int source_length = sizeof(*source);
+    std::lock_guard<std::recursive_mutex> guard(state_lock);
 
-    strcpy(dump, _("[no dump ready]"));	// initial, pre-read filler
+    if (pending.empty() || receiving)
+	return;
 
-    FD_ZERO(&read_set);
-    FD_SET(server_fd, &read_set);
-    if (select(server_fd+1, &read_set, NULL, NULL, &tv) < 0)
+    // take what is due out of the list before sending.
+    uint64_t now = now_msec();
+    std::vector<std::pair<string, BibleSyncPending>> due;
+    for (auto held = pending.begin(); held != pending.end(); /* below */)
     {
-	(*nav_func)('E', EMPTY,
-		    EMPTY, EMPTY, EMPTY, EMPTY, EMPTY,
-		    BSP + _("select < 0"), dump);
-	return -1;
+	if (all ||
+	    (now >= held->second.last + coalesce_quiet) ||
+	    (now >= held->second.first + coalesce_max))
+	{
+	    due.emplace_back(held->first, held->second);
+	    held = pending.erase(held);
+	}
+	else
+	    ++held;
     }
+    if (due.empty())
+	return;
 
-    if ((FD_ISSET(server_fd, &read_set)) &&
-	((recv_size = recvfrom(server_fd, (char *)buffer, BSP_MAX_SIZE,
-			       0, (sockaddr *)source,
-			       &source_length)) < 0))
+    std::vector<BibleSync_xmit_record> record(due.size());
+    std::vector<BibleSync_xmit_status> status(due.size());
+    for (size_t i = 0; i < due.size(); ++i)
     {
-	(*nav_func)('E', EMPTY,
-		    EMPTY, EMPTY, EMPTY, EMPTY, EMPTY,
-		    BSP + _("recvfrom < 0"), dump);
-	return -1;
+	record[i].bible  = due[i].second.bible;
+	record[i].ref    = due[i].second.ref;
+	record[i].alt    = due[i].second.alt;
+	record[i].group  = due[i].first;
+	record[i].domain = due[i].second.domain;
     }
-    return recv_size;
+    TransmitBatch(record.data(), record.size(), status.data());
 }
 
-// speaker transmitter
-// sanity checks for permission to xmit,
-// then format and ship it.
-BibleSync_xmit_status
-BibleSync::TransmitInternal(char message_type,
-			    string bible,
-			    string ref,
-			    string alt,
-			    string group,
-			    string domain)
+// when the next held navigation must go out; 0 if none held.
+uint64_t BibleSync::CoalesceDue(void)
 {
-    if (mode == BSP_MODE_DISABLE)
-	return BSP_XMIT_FAILED;
+    uint64_t due = 0;
 
-    if (receiving && (message_type == BSP_SYNC))
-	return BSP_XMIT_RECEIVING;	// if this occurs, app re-xmit'd. *NO*.
+    for (auto &held : pending)
+    {
+	uint64_t when = min(held.second.last + coalesce_quiet,
+			    held.second.first + coalesce_max);
+	if ((due == 0) || (when < due))
+	    due = when;
+    }
+    return due;
+}
 
-    if (client_fd < 0)
-	return BSP_XMIT_NO_SOCKET;
+// sender-side coalescing window.  turning it off sends what is held.
+void BibleSync::setCoalesce(unsigned int quiet_ms, unsigned int max_delay_ms)
+{
+    std::lock_guard<std::recursive_mutex> guard(state_lock);
 
-    if ((message_type != BSP_ANNOUNCE) &&
-	(message_type != BSP_SYNC) &&
-	(message_type != BSP_BEACON) &&
-	(message_type != BSP_CHAT))
-	return BSP_XMIT_BAD_TYPE;
+    if (quiet_ms == 0)
+	FlushCoalesced(true);
+    coalesce_quiet = quiet_ms;
+    coalesce_max = max(quiet_ms, max_delay_ms);
+}
 
-    if ((mode == BSP_MODE_AUDIENCE) &&
-	((message_type == BSP_SYNC) || (message_type == BSP_BEACON)))
-	return BSP_XMIT_NO_AUDIENCE_XMIT;
+// an 'E' for the app, unless it repeats, within the coalescing
+// interval, one of its kind from the same sender: that is only
+// counted.  no text is made here; see getErrorText().
+// with a packet at hand, its dump goes along as dump mode says.
+void BibleSync::ReportError(BibleSync_error error, string_view detail,
+			    const struct sockaddr_in *source,
+			    const uuid_t *speaker,
+			    string_view speakerkey,
+			    string_view bible, string_view ref,
+			    string_view alt, string_view group,
+			    string_view domain, string_view dump)
+{
+    std::lock_guard<std::recursive_mutex> guard(state_lock);
 
-    BibleSyncContent content;
-    BibleSyncMessage bsp;
-    string body = "";
-
-    // all name/value pairs.
-    content[BSP_APP_NAME]                 = application;
-    content[BSP_APP_VERSION]              = version;
-    content[BSP_APP_USER]                 = user;
-    content[BSP_APP_DEVICE]               = device;
-    content[BSP_APP_OS]                   = BSP_OS;
-    content[BSP_APP_INSTANCE_UUID]        = uuid_string;
-    if (message_type != BSP_CHAT)
-	content[BSP_MSG_SYNC_BIBLEABBREV] = bible;
-    else {
-	// innoculate chat content against internal \n.
-	for (char *chase = (char *)bible.c_str(); chase = strchr(chase, '\n'); ++chase)
-	    *chase = '\t';
-	content[BSP_MSG_CHAT]	          = bible;	// overload.
-    }
-    content[BSP_MSG_SYNC_VERSE]           = ref;
-    content[BSP_MSG_SYNC_ALTVERSE]        = alt;
-    content[BSP_MSG_SYNC_GROUP]           = group;
-    content[BSP_MSG_SYNC_DOMAIN]          = domain;
-    content[BSP_MSG_PASSPHRASE]           = passphrase;
+    if (!HasCallback())
+	return;
 
-    // header.
-    bsp.magic = BSP_MAGIC;
-    bsp.version = BSP_PROTOCOL;
-    bsp.msg_type = message_type;
-    bsp.num_packets = 1;
-    bsp.index_packet = 0;
-    memcpy((void *)&bsp.uuid, (const void *)&uuid, sizeof(uuid_t));
-    memset((void *)&bsp.reserved, 0, BSP_RES_SIZE);
+    if (error_interval != 0)
+    {
+	struct in_addr addr;
+	BibleSyncErrorSeen *slot = NULL;
+	size_t hash = std::hash<string_view>()(detail);
 
-    // body prep.
-    int field_count = outbound_fill_count[message_type];
+	addr.s_addr = ((source != NULL)
+		       ? source->sin_addr.s_addr : htonl(INADDR_ANY));
+	for (BibleSyncErrorSeen &seen : errors_seen)
+	{
+	    if (seen.error == BSP_ERROR_NONE)
+	    {
+		if ((slot == NULL) || (slot->error != BSP_ERROR_NONE))
+		    slot = &seen;
+	    }
+	    else if ((seen.error == error) &&
+		     (seen.addr.s_addr == addr.s_addr) &&
+		     (seen.detail_hash == hash))
+	    {
+		// one more just like it, for the summary.
+		++seen.repeats;
+		Count(BSP_STAT_ERRORS_COALESCED);
+		return;
+	    }
+	    else if ((slot == NULL) ||
+		     ((slot->error != BSP_ERROR_NONE) &&
+		      (seen.since < slot->since)))
+		slot = &seen;		// oldest so far.
+	}
 
-    for (int i = 0; i < field_count; ++i)
-    {
-	string &filler = (((message_type == BSP_CHAT) &&
-			   (i == CHAT_OUTBOUND_INDEX))
-			  ? chat_field
-			  : outbound_fill[i]);
-	body += filler + "=" + content[filler] + "\n";
+	// the table is full: the oldest gives way, reporting what it has.
+	if (slot->error != BSP_ERROR_NONE)
+	    ReportRepeats(*slot);
+	slot->error = error;
+	slot->addr = addr;
+	slot->since = now_msec();
+	slot->repeats = 0;
+	slot->detail_hash = hash;
+	snprintf(slot->detail, sizeof(slot->detail), "%.*s",
+		 (int)detail.length(), detail.data());
     }
 
-    // ship it.
-    strncpy(bsp.body, body.c_str(), BSP_MAX_PAYLOAD);
-    unsigned int xmit_size = min(BSP_MAX_SIZE,
-				 BSP_HEADER_SIZE + body.length());
+    if (source != NULL)
+	strcpy(error_source, inet_ntoa(source->sin_addr));
+    else
+	error_source[0] = '\0';
+    error_repeats = 0;
+    error_at_hand = error;
+
+    if (dump_packet != NULL)
+	Deliver('E', speaker, speakerkey,
+		bible, ref, alt, group, domain,
+		detail);
+    else
+	Dispatch('E', speaker, speakerkey,
+		 bible, ref, alt, group, domain,
+		 detail, dump);
+}
+
+// one 'E' for the repeats of a coalesced error, if there were any.
+void BibleSync::ReportRepeats(BibleSyncErrorSeen &seen)
+{
+    if (seen.repeats == 0)
+	return;
+
+    if (seen.addr.s_addr != htonl(INADDR_ANY))
+	strcpy(error_source, inet_ntoa(seen.addr));
+    else
+	error_source[0] = '\0';
+    error_repeats = seen.repeats;
+    error_at_hand = seen.error;
+    seen.repeats = 0;
+
+    Dispatch('E', NULL, EMPTY,
+	     EMPTY, EMPTY, EMPTY, EMPTY, EMPTY,
+	     seen.detail, EMPTY);
+    error_repeats = 0;
+}
 
-    // force last == newline: attempt to preserve body format when long.
-    // (cuts off excessively long verse references and chat messages.)
-    ((unsigned char*)&bsp)[BSP_MAX_SIZE-1] = '\n';
+// report coalesced errors whose interval is over, or all of them.
+// a kind that repeated keeps counting for another interval; one
+// that did not is forgotten, and its next is reported at once.
+void BibleSync::FlushErrors(bool all)
+{
+    std::lock_guard<std::recursive_mutex> guard(state_lock);
+    uint64_t now = 0;
 
-    BibleSync_xmit_status retval;
-    if (sendto(client_fd, (char *)&bsp, xmit_size, 0,
-	       (struct sockaddr *)&client, sizeof(client)) >= 0)
+    for (BibleSyncErrorSeen &seen : errors_seen)
     {
-	retval = BSP_XMIT_OK;
+	if (seen.error == BSP_ERROR_NONE)
+	    continue;
+	if (now == 0)
+	    now = now_msec();
+	if (!all && (now < seen.since + error_interval))
+	    continue;
+
+	bool repeated = (seen.repeats > 0);
+	ReportRepeats(seen);
+	if (repeated && !all)
+	    seen.since = now;
+	else
+	    seen.error = BSP_ERROR_NONE;
     }
-    else
+}
+
+// when the next coalescing interval ends; 0 if none running.
+uint64_t BibleSync::ErrorsDue(void)
+{
+    uint64_t due = 0;
+
+    for (BibleSyncErrorSeen &seen : errors_seen)
     {
-	retval = BSP_XMIT_FAILED;
-	(*nav_func)('E', EMPTY,
-		    EMPTY, EMPTY, EMPTY, EMPTY, EMPTY,
-		    BSP + _("Transmit failed.\n"),
-		    _("Unable to multicast; BibleSync is now disabled. "
-		      "If your network connection changed while this program "
-		      "was active, it may be sufficient to re-enable."));
-	Shutdown();
+	if (seen.error == BSP_ERROR_NONE)
+	    continue;
+	uint64_t when = seen.since + error_interval;
+	if ((due == 0) || (when < due))
+	    due = when;
     }
-    return retval;
+    return due;
+}
+
+// receive rate limits, per sender uuid and per source address.
+void BibleSync::setRateLimit(unsigned int uuid_rate, unsigned int uuid_burst,
+			     unsigned int source_rate,
+			     unsigned int source_burst)
+{
+    std::lock_guard<std::recursive_mutex> guard(state_lock);
+
+    SetLimit(inbound.by_uuid, uuid_rate, uuid_burst);
+    SetLimit(inbound.by_source, source_rate, source_burst);
+}
+
+// receiver-side coalescing window.  turning it off reports what is held.
+void BibleSync::setErrorCoalesce(unsigned int interval_ms)
+{
+    std::lock_guard<std::recursive_mutex> guard(state_lock);
+
+    if (interval_ms == 0)
+	FlushErrors(true);
+    error_interval = interval_ms;
+}
+
+// an error's text in the current locale.
+string_view BibleSync::getErrorText(BibleSync_error error)
+{
+    text_refresh();
+    return (((error > BSP_ERROR_NONE) && (error < N_BSP_ERROR))
+	    ? translated(error) : "");
+}
+
+// statistics snapshot.
+BibleSync_stats BibleSync::getStats(void)
+{
+    BibleSync_stats snapshot;
+
+    for (int i = 0; i < N_BSP_STAT; ++i)
+	snapshot.value[i] = stats[i].load(std::memory_order_relaxed);
+    std::lock_guard<std::recursive_mutex> guard(state_lock);
+    snapshot.value[BSP_STAT_KERNEL_DROPPED] += KernelDrops(server_fd);
+    return snapshot;
+}
+
+// printable names of statistics, e.g. for logging.
+static const char *stat_names[] = {
+    "recv.announce", "recv.sync", "recv.beacon", "recv.chat", "recv.bytes",
+    "sent.announce", "sent.sync", "sent.beacon", "sent.chat", "sent.bytes",
+    "send.failed",
+    "bad.size", "bad.magic", "bad.version", "bad.type", "bad.count",
+    "bad.body", "missing.header", "spoof", "echo",
+    "event.A", "event.N", "event.S", "event.D", "event.C", "event.M",
+    "event.E",
+    "speakers.added", "speakers.expired", "unrouted",
+    "fragments", "reassembled", "fragments.dropped", "kernel.dropped",
+    "errors.coalesced", "rate.limited"
+};
+static_assert(sizeof(stat_names) / sizeof(stat_names[0]) == N_BSP_STAT,
+	      "stat_names[] out of step with BSP_STAT_*");
+
+const char *BibleSync::getStatName(BibleSync_stat s)
+{
+    return ((s < N_BSP_STAT) ? stat_names[s] : "");
 }
 
 //
@@ -921,39 +3251,231 @@ bool BibleSync::setPrivate(bool privacy)
 		       (char *)&ttl, sizeof(ttl)) >= 0);
 }
 
+// remembered for when the socket is next made; applied now if it exists.
+// a multiplexer's session has no socket of its own to filter.
+bool BibleSync::setKernelFilter(bool filter)
+{
+    std::lock_guard<std::recursive_mutex> guard(state_lock);
+
+    kernel_filter = filter;
+    return AttachFilter(server_fd, filter, &uuid);
+}
+
 //
 // user decision to listen or not to a certain speaker.
 // speakerkey is the UUID given during (*nav_func)('S', ...).
 //
 void BibleSync::listenToSpeaker(bool listen, string speakerkey)
 {
-    BibleSyncSpeakerMapIterator object = speakers.find(speakerkey);
+    std::lock_guard<std::recursive_mutex> guard(state_lock);
+    uuid_t key;
+
+    if (!uuid_scan(speakerkey, key))
+	return;
+
+    BibleSyncSpeaker *speaker = FindSpeaker(key);
+    if (speaker != NULL)
+    {
+	speaker->listen = listen;
+    }
+}
+
+// speaker table: where uuid's probe sequence starts.
+// uuids are mostly random already; fold and mix anyway.
+unsigned int BibleSync::SpeakerSlot(const uuid_t &u)
+{
+    uint64_t half[2];
+
+    memcpy((void *)half, (const void *)&u, sizeof(half));
+    return (unsigned int)(((half[0] ^ half[1]) * 0x9e3779b97f4a7c15ULL) >> 32)
+	& (speakers.size() - 1);
+}
+
+// speaker table: known speaker, or NULL.
+BibleSync::BibleSyncSpeaker *BibleSync::FindSpeaker(const uuid_t &u)
+{
+    if (speaker_count == 0)
+	return NULL;
+
+    unsigned int mask = speakers.size() - 1;
+    for (unsigned int i = SpeakerSlot(u); speakers[i].used; i = (i + 1) & mask)
+    {
+	if (memcmp((const void *)&speakers[i].uuid,
+		   (const void *)&u, sizeof(uuid_t)) == 0)
+	    return &speakers[i];
+    }
+    return NULL;
+}
+
+// speaker table: new speaker, not yet known, grown as needed.
+// previously-returned speaker pointers are then invalid.
+BibleSync::BibleSyncSpeaker &BibleSync::AddSpeaker(const uuid_t &u)
+{
+    if ((speaker_count + 1) * 2 > speakers.size())
+    {
+	std::vector<BibleSyncSpeaker> old;
+	old.swap(speakers);
+	speakers.assign(max((size_t)BSP_SPEAKER_TABLE_MIN, old.size() * 2),
+			BibleSyncSpeaker());
+	speaker_count = 0;
+	for (BibleSyncSpeaker &s : old)
+	    if (s.used)
+		AddSpeaker(s.uuid) = s;
+    }
+
+    unsigned int mask = speakers.size() - 1;
+    unsigned int i = SpeakerSlot(u);
+    while (speakers[i].used)
+	i = (i + 1) & mask;
+
+    ++speaker_count;
+    speakers[i] = BibleSyncSpeaker();
+    memcpy((void *)&speakers[i].uuid, (const void *)&u, sizeof(uuid_t));
+    speakers[i].used = true;
+    return speakers[i];
+}
+
+// speaker table: forget one, shifting back any successors in its
+// probe run, so that lookups never need tombstones.
+void BibleSync::RemoveSpeaker(BibleSyncSpeaker *speaker)
+{
+    unsigned int mask = speakers.size() - 1;
+    unsigned int hole = speaker - &speakers[0];
+
+    for (unsigned int i = (hole + 1) & mask; speakers[i].used; i = (i + 1) & mask)
+    {
+	// move i back to the hole unless its home lies in (hole, i].
+	unsigned int home = SpeakerSlot(speakers[i].uuid);
+	if (((i - home) & mask) >= ((i - hole) & mask))
+	{
+	    speakers[hole] = speakers[i];
+	    hole = i;
+	}
+    }
+    speakers[hole].used = false;
+    --speaker_count;
+}
+
+// timer wheel: place a speaker's timer where it will be found
+// no earlier than deadline.  beyond the wheel's reach, it goes
+// to the farthest slot and is simply re-inserted from there.
+void BibleSync::WheelInsert(const BibleSyncTimer &timer, uint64_t deadline)
+{
+    uint64_t tick = (deadline + BSP_WHEEL_MSEC - 1) / BSP_WHEEL_MSEC;
+    uint64_t when;
+
+    if (tick <= wheel_now)
+	tick = wheel_now + 1;
+
+    if (tick - wheel_now < BSP_WHEEL_SLOTS)
+    {
+	wheel[0][tick & (BSP_WHEEL_SLOTS - 1)].push_back(timer);
+	when = tick;
+    }
+    else
+    {
+	uint64_t span = tick >> BSP_WHEEL_BITS;
+	uint64_t last = (wheel_now >> BSP_WHEEL_BITS) + BSP_WHEEL_SLOTS - 1;
+	if (span > last)
+	    span = last;
+	wheel[1][span & (BSP_WHEEL_SLOTS - 1)].push_back(timer);
+	when = span << BSP_WHEEL_BITS;	// when it cascades to level 0.
+    }
+
+    when *= BSP_WHEEL_MSEC;
+    if ((next_tick == 0) || (when < next_tick))
+	next_tick = when;
+}
+
+// timer wheel: msec of the next tick with anything to do; 0 if none.
+uint64_t BibleSync::WheelNext(void)
+{
+    if (speaker_count == 0)
+	return 0;
 
-    if (object != speakers.end())
+    for (uint64_t tick = wheel_now + 1;
+	 tick < wheel_now + BSP_WHEEL_SLOTS;
+	 ++tick)
     {
-	object->second.listen = listen;
+	if ((tick & (BSP_WHEEL_SLOTS - 1)) == 0)
+	    return tick * BSP_WHEEL_MSEC;	// cascade.
+	if (!wheel[0][tick & (BSP_WHEEL_SLOTS - 1)].empty())
+	    return tick * BSP_WHEEL_MSEC;
     }
+    return (wheel_now + BSP_WHEEL_SLOTS) * BSP_WHEEL_MSEC;
 }
 
 //
-// called from ReceiveInternal().  ages entries by one, waiting
-// to reach zero.  on zero, call (*nav_func)('D', ...) to inform
-// the app that the speaker is dead, then eliminate the element.
+// called from Housekeeping().  runs the timer wheel up to now.
+// speakers whose deadline has passed are dead: call (*nav_func)('D', ...)
+// to inform the app, then eliminate the element.  others, heard from
+// since their timer was set, are re-inserted at their new deadline.
 //
-void BibleSync::ageSpeakers()
+void BibleSync::ageSpeakers(uint64_t now)
 {
-    for (BibleSyncSpeakerMapIterator object = speakers.begin();
-	 object != speakers.end();
-	 /* no increment here */)
+    uint64_t target = now / BSP_WHEEL_MSEC;
+    std::vector<BibleSyncTimer> &dead = wheel_dead;
+
+    dead.clear();
+    // nothing to age: no need to step through the idle time.
+    if (speaker_count == 0)
+    {
+	wheel_now = max(wheel_now, target);
+	return;
+    }
+
+    while (wheel_now < target)
     {
-	BibleSyncSpeakerMapIterator victim = object++;	// loop increment
-	if (--(victim->second.countdown) == 0)
+	++wheel_now;
+
+	// start of a level 0 round: bring in the next level 1 slot.
+	if ((wheel_now & (BSP_WHEEL_SLOTS - 1)) == 0)
+	{
+	    // re-insertion never lands in the slot being emptied, so it
+	    // is walked in place and keeps its capacity for next time.
+	    std::vector<BibleSyncTimer> &due =
+		wheel[1][(wheel_now >> BSP_WHEEL_BITS) & (BSP_WHEEL_SLOTS - 1)];
+	    for (BibleSyncTimer &timer : due)
+	    {
+		BibleSyncSpeaker *speaker = FindSpeaker(timer.uuid);
+		if ((speaker != NULL) && (speaker->serial == timer.serial))
+		    WheelInsert(timer, speaker->deadline);
+	    }
+	    due.clear();
+	}
+
+	std::vector<BibleSyncTimer> &due =
+	    wheel[0][wheel_now & (BSP_WHEEL_SLOTS - 1)];
+	for (BibleSyncTimer &timer : due)
 	{
-	    (*nav_func)('D', victim->first,
-			EMPTY, EMPTY, EMPTY, EMPTY, EMPTY,
-			EMPTY, EMPTY);
-	    speakers.erase(victim);
+	    BibleSyncSpeaker *speaker = FindSpeaker(timer.uuid);
+	    if ((speaker == NULL) || (speaker->serial != timer.serial))
+		continue;		// stale timer.
+	    if (speaker->deadline <= now)
+		dead.push_back(timer);
+	    else
+		WheelInsert(timer, speaker->deadline);
 	}
+	due.clear();
+    }
+
+    // removal shifts entries about: collect first, then remove.
+    // a 'D' callback may disable us, which clears the speakers and
+    // tells of the rest itself, or may age them again, reusing dead.
+    for (size_t i = 0; (i < dead.size()) && (mode != BSP_MODE_DISABLE); ++i)
+    {
+	BibleSyncTimer timer = dead[i];
+	BibleSyncSpeaker *speaker = FindSpeaker(timer.uuid);
+	char key[BSP_UUID_PRINT_LENGTH];
+
+	if ((speaker == NULL) || (speaker->serial != timer.serial))
+	    continue;			// gone meanwhile.
+	RemoveSpeaker(speaker);
+	Count(BSP_STAT_SPEAKERS_EXPIRED);
+	uuid_dump(timer.uuid, key);
+	Dispatch('D', &timer.uuid, key,
+		 EMPTY, EMPTY, EMPTY, EMPTY, EMPTY,
+		 EMPTY, EMPTY);
     }
 }
 
@@ -964,19 +3486,24 @@ void BibleSync::ageSpeakers()
 //
 void BibleSync::clearSpeakers()
 {
-    if (nav_func != NULL)
+    for (BibleSyncSpeaker &s : speakers)
     {
-	for (BibleSyncSpeakerMapIterator object = speakers.begin();
-	     object != speakers.end();
-	     ++object)
+	if (s.used)
 	{
-	    (*nav_func)('D', object->first,
-			EMPTY, EMPTY, EMPTY, EMPTY, EMPTY,
-			EMPTY, EMPTY);
+	    char key[BSP_UUID_PRINT_LENGTH];
+
+	    uuid_dump(s.uuid, key);
+	    Dispatch('D', &s.uuid, key,
+		     EMPTY, EMPTY, EMPTY, EMPTY, EMPTY,
+		     EMPTY, EMPTY);
 	}
     }
 
     speakers.clear();
+    speaker_count = 0;
+    for (int level = 0; level < BSP_WHEEL_LEVELS; ++level)
+	for (int slot = 0; slot < BSP_WHEEL_SLOTS; ++slot)
+	    wheel[level][slot].clear();
 }
 
 #ifndef WIN32
@@ -1043,10 +3570,10 @@ int BibleSync::get_default_if_name(char *name)
     return 0;
 }
 
-void BibleSync::InterfaceAddress()
+struct in_addr BibleSync::ResolveInterface()
 {
-    // cancel any old interface value.
     // we must fail with current info, if at all.
+    struct in_addr interface_addr;
     interface_addr.s_addr = htonl(0x7f000001);	// 127.0.0.1 fallback
 
     char gw_if[IF_NAMESIZE];	// default gateway interface.
@@ -1060,7 +3587,7 @@ void BibleSync::InterfaceAddress()
 
 	if (getifaddrs(&ifaddr) == -1) {
 	    perror("getifaddrs");
-	    return;
+	    return interface_addr;
 	}
 
 	for (ifa = ifaddr; ifa != NULL; ifa = ifa->ifa_next) {
@@ -1076,7 +3603,7 @@ void BibleSync::InterfaceAddress()
 	}
 	freeifaddrs(ifaddr);
     }
-    return;
+    return interface_addr;
 }
 
 #else /* linux */
@@ -1101,10 +3628,10 @@ void BibleSync::InterfaceAddress()
 		"tr ' ' '\\n' | grep '^[0-9.][0-9.]*$' | head -1 | tr -d '\\n'"
 #endif
 
-void BibleSync::InterfaceAddress()
+struct in_addr BibleSync::ResolveInterface()
 {
-    // cancel any old interface value.
     // we must fail with current info, if at all.
+    struct in_addr interface_addr;
     interface_addr.s_addr = htonl(0x7f000001);	// 127.0.0.1 fallback
 
     FILE *c;
@@ -1119,17 +3646,17 @@ void BibleSync::InterfaceAddress()
 	pclose(c);
     }
 
-    return;
+    return interface_addr;
 }
 
 #endif /* linux */
 
 #else	/* WIN32 */
 
-void BibleSync::InterfaceAddress()
+struct in_addr BibleSync::ResolveInterface()
 {
-    // cancel any old interface value.
     // we must fail with current info, if at all.
+    struct in_addr interface_addr;
     interface_addr.s_addr = htonl(0x7f000001);	// 127.0.0.1 fallback
 
     // this code is rudely derived from, and courtesy of,
@@ -1141,12 +3668,12 @@ void BibleSync::InterfaceAddress()
 
     WSADATA WinsockData;
     if (WSAStartup(MAKEWORD(2, 2), &WinsockData) != 0) {
-        return;
+        return interface_addr;
     }
 
     SOCKET sd = WSASocket(AF_INET, SOCK_DGRAM, 0, 0, 0, 0);
     if (sd == SOCKET_ERROR) {
-	return;
+	return interface_addr;
     }
 
     INTERFACE_INFO InterfaceList[20];
@@ -1154,7 +3681,7 @@ void BibleSync::InterfaceAddress()
     if (WSAIoctl(sd, SIO_GET_INTERFACE_LIST, 0, 0, &InterfaceList,
 			sizeof(InterfaceList), &nBytesReturned, 0, 0)
 	== SOCKET_ERROR) {
-	return;
+	return interface_addr;
     }
 
     int nNumInterfaces = nBytesReturned / sizeof(INTERFACE_INFO);
@@ -1173,6 +3700,191 @@ void BibleSync::InterfaceAddress()
 	    break;
 	}
     }
-    return;
+    return interface_addr;
 }
 #endif /* WIN32 */
+
+// the interface address, shared by every object in the process.
+// a change seen, or a failed transmit, bumps the generation; the
+// address is resolved again, once, when next someone wants it.
+
+#ifdef linux
+#include <linux/netlink.h>
+#include <linux/rtnetlink.h>
+#endif /* linux */
+
+static std::mutex interface_lock;
+static struct in_addr interface_cache;
+static uint64_t interface_changes = 1;		// generation now.
+static uint64_t interface_resolved = 0;		// of interface_cache.
+#ifdef linux
+static int netlink_fd = -1;			// rtnetlink, or none.
+#endif /* linux */
+
+// drain rtnetlink news: any address or route change may move the
+// default interface.  lost news (ENOBUFS) may have been of one, too.
+// called with interface_lock held.
+static void interface_news(void)
+{
+#ifdef linux
+    if (netlink_fd < 0)
+	return;
+
+    char buffer[8192];
+    bool changed = false;
+    ssize_t length;
+
+    while ((length = recv(netlink_fd, buffer, sizeof(buffer),
+			  MSG_DONTWAIT)) != 0)
+    {
+	if (length < 0)
+	{
+	    if (errno == EINTR)
+		continue;
+	    changed = changed || (errno == ENOBUFS);
+	    break;
+	}
+
+	for (struct nlmsghdr *h = (struct nlmsghdr *)buffer;
+	     NLMSG_OK(h, (size_t)length);
+	     h = NLMSG_NEXT(h, length))
+	{
+	    if ((h->nlmsg_type == RTM_NEWADDR) ||
+		(h->nlmsg_type == RTM_DELADDR) ||
+		(h->nlmsg_type == RTM_NEWROUTE) ||
+		(h->nlmsg_type == RTM_DELROUTE))
+		changed = true;
+	}
+    }
+    if (changed)
+	++interface_changes;
+#endif /* linux */
+}
+
+// the current address, and the generation it belongs to.
+// the first call subscribes to network changes, where we can.
+struct in_addr BibleSync::CachedInterface(uint64_t &generation)
+{
+    std::lock_guard<std::mutex> guard(interface_lock);
+
+#ifdef linux
+    if (netlink_fd < 0)
+    {
+	netlink_fd = socket(AF_NETLINK, SOCK_RAW | SOCK_CLOEXEC,
+			    NETLINK_ROUTE);
+	if (netlink_fd >= 0)
+	{
+	    struct sockaddr_nl local;
+	    memset((char *)&local, 0, sizeof(local));
+	    local.nl_family = AF_NETLINK;
+	    local.nl_groups = RTMGRP_IPV4_IFADDR | RTMGRP_IPV4_ROUTE;
+	    if (bind(netlink_fd, (struct sockaddr *)&local,
+		     sizeof(local)) < 0)
+	    {
+		close(netlink_fd);
+		netlink_fd = -1;
+	    }
+	}
+    }
+#endif /* linux */
+
+    interface_news();
+    if (interface_resolved != interface_changes)
+    {
+	interface_cache = ResolveInterface();
+	interface_resolved = interface_changes;
+    }
+    generation = interface_changes;
+    return interface_cache;
+}
+
+// time to look again?  at most every BSP_INTERFACE_CHECK_MSEC.
+bool BibleSync::InterfaceDue(uint64_t &next_check)
+{
+    uint64_t now = now_msec();
+
+    if (now < next_check)
+	return false;
+    next_check = now + BSP_INTERFACE_CHECK_MSEC;
+    return true;
+}
+
+// has anything happened since generation?
+bool BibleSync::InterfaceChanged(uint64_t generation)
+{
+    std::lock_guard<std::mutex> guard(interface_lock);
+
+    interface_news();
+    return (interface_changes != generation);
+}
+
+// whatever we knew may be wrong: resolve again when next asked.
+void BibleSync::InterfaceLost(void)
+{
+    std::lock_guard<std::mutex> guard(interface_lock);
+
+    ++interface_changes;
+}
+
+void BibleSync::InterfaceAddress()
+{
+    interface_addr = CachedInterface(interface_generation);
+}
+
+// move a receive socket's group membership between interfaces.
+// the old one may be gone already, and its membership with it.
+bool BibleSync::Rejoin(int fd, struct in_addr from, struct in_addr to)
+{
+    struct ip_mreq multicast_req;
+
+    multicast_req.imr_multiaddr.s_addr = inet_addr(BSP_MULTICAST);
+    multicast_req.imr_interface.s_addr = from.s_addr;
+    (void)setsockopt(fd, IPPROTO_IP, IP_DROP_MEMBERSHIP,
+		     (char *)&multicast_req, sizeof(multicast_req));
+
+    multicast_req.imr_interface.s_addr = to.s_addr;
+    return ((setsockopt(fd, IPPROTO_IP, IP_ADD_MEMBERSHIP,
+			(char *)&multicast_req, sizeof(multicast_req)) >= 0) ||
+	    (errno == EADDRINUSE));	// already there.
+}
+
+// the network changed under us: carry on from the new interface,
+// rather than tearing everything down, and tell its network we're here.
+void BibleSync::FollowInterface(void)
+{
+    if ((client_fd < 0) ||
+	!InterfaceDue(next_interface_check) ||
+	!InterfaceChanged(interface_generation))
+	return;
+
+    (void)MoveInterface();
+}
+
+// resolve the interface again, and move our sockets if it has changed.
+// false if they could not be moved, which has been reported.
+bool BibleSync::MoveInterface(void)
+{
+    struct in_addr from = interface_addr;
+    InterfaceAddress();
+    if (interface_addr.s_addr == from.s_addr)
+	return true;
+
+    string result = "";
+    if (setsockopt(client_fd, IPPROTO_IP, IP_MULTICAST_IF,
+		   (char *)&interface_addr, sizeof(interface_addr)) < 0)
+	result += (string)" IP_MULTICAST_IF " + inet_ntoa(interface_addr);
+    if ((server_fd >= 0) && !Rejoin(server_fd, from, interface_addr))
+	result += " IP_ADD_MEMBERSHIP";
+
+    if (result != "")
+    {
+	ReportError(BSP_ERROR_NETWORK_CHANGE, EMPTY, NULL, NULL,
+		    EMPTY, EMPTY, EMPTY, EMPTY, EMPTY, EMPTY, result);
+	return false;
+    }
+
+    // after a failed send, the retried message speaks for us.
+    if (!recovering)
+	TransmitInternal(BSP_ANNOUNCE);
+    return true;
+}
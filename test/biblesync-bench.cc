@@ -0,0 +1,671 @@
+/*
+ * BibleSync library
+ * biblesync-bench.cc
+ *
+ * Microbenchmarks of the packet path, to catch regressions.
+ * Built with -DBUILD_TOOLS=ON, or by BUILD_TESTING (on by default),
+ * under which ctest runs the budget and ratelimit checks.  By hand:
+ *	$ ./biblesync_bench [scale]
+ *	$ ./biblesync_bench budget
+ *	$ ./biblesync_bench ratelimit
+ * scale multiplies iteration counts (default 1).
+ * budget instead checks that, once warm, receiving, sending and aging
+ * allocate nothing for an event-interface application; exit status 1
+ * and a line per offender if they do.
+ * ratelimit checks that our own looped-back packets are not charged
+ * to our host's allowance; exit status 1 if a peer there is dropped.
+ *
+ * Reports per operation: wall time, heap allocations, and, where
+ * perf_event_open(2) is permitted, cycles, instructions and cache
+ * misses.
+ *
+ * All files related to implementation of BibleSync, including program
+ * source, READMEs, manual pages, and related similar documents, are in
+ * the public domain.  As a matter of simple decency, your social
+ * obligations are to credit the source and to coordinate any changes you
+ * make back to the origin repository.  These obligations are non-
+ * binding for public domain software, but they are to be seriously
+ * handled nonetheless.
+ */
+
+#include <biblesync.hh>
+#include <errno.h>
+#include <new>
+#ifdef linux
+#include <linux/perf_event.h>
+#include <sys/ioctl.h>
+#include <sys/syscall.h>
+#endif
+
+// every heap allocation, the library's included.
+static unsigned long allocations = 0;
+
+void *operator new(size_t size)
+{
+    ++allocations;
+    void *p = malloc(size ? size : 1);
+    if (p == NULL)
+	throw std::bad_alloc();
+    return p;
+}
+void operator delete(void *p) noexcept { free(p); }
+void operator delete(void *p, size_t) noexcept { free(p); }
+
+static uint64_t now_nsec(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+// hardware counters, where the kernel lets us have them.
+#define	N_COUNTER	3
+static const char *counter_name[N_COUNTER] = {
+    "cycles", "instr", "cache-miss"
+};
+
+class Counters {
+public:
+    Counters()
+    {
+	for (int i = 0; i < N_COUNTER; ++i)
+	    fd[i] = -1;
+#ifdef linux
+	static const uint64_t config[N_COUNTER] = {
+	    PERF_COUNT_HW_CPU_CYCLES,
+	    PERF_COUNT_HW_INSTRUCTIONS,
+	    PERF_COUNT_HW_CACHE_MISSES
+	};
+	for (int i = 0; i < N_COUNTER; ++i)
+	{
+	    struct perf_event_attr attr;
+	    memset(&attr, 0, sizeof(attr));
+	    attr.size = sizeof(attr);
+	    attr.type = PERF_TYPE_HARDWARE;
+	    attr.config = config[i];
+	    attr.disabled = 1;
+	    attr.exclude_kernel = 1;
+	    attr.exclude_hv = 1;
+	    fd[i] = syscall(SYS_perf_event_open, &attr, 0, -1, -1, 0);
+	}
+#endif
+    }
+    ~Counters()
+    {
+	for (int i = 0; i < N_COUNTER; ++i)
+	    if (fd[i] >= 0)
+		close(fd[i]);
+    }
+    void start(void)
+    {
+#ifdef linux
+	for (int i = 0; i < N_COUNTER; ++i)
+	    if (fd[i] >= 0)
+	    {
+		ioctl(fd[i], PERF_EVENT_IOC_RESET, 0);
+		ioctl(fd[i], PERF_EVENT_IOC_ENABLE, 0);
+	    }
+#endif
+    }
+    void stop(void)
+    {
+#ifdef linux
+	for (int i = 0; i < N_COUNTER; ++i)
+	    if (fd[i] >= 0)
+		ioctl(fd[i], PERF_EVENT_IOC_DISABLE, 0);
+#endif
+    }
+    // accumulated count, or -1 if unavailable.
+    long long value(int i)
+    {
+	uint64_t v;
+	if ((fd[i] < 0) || (read(fd[i], &v, sizeof(v)) != sizeof(v)))
+	    return -1;
+	return (long long)v;
+    }
+private:
+    int fd[N_COUNTER];
+};
+
+static Counters *counters;
+
+// one benchmark's measurement, accumulated over possibly many
+// separately-timed stretches.
+class Measure {
+public:
+    Measure() : nsec(0), allocs(0), ops(0) {}
+    void start(void)
+    {
+	allocs_at = allocations;
+	counters->start();
+	nsec_at = now_nsec();
+    }
+    void stop(unsigned long n)
+    {
+	nsec += now_nsec() - nsec_at;
+	counters->stop();
+	allocs += allocations - allocs_at;
+	ops += n;
+    }
+    void report(const char *name)
+    {
+	printf("%-28s %10.1f %8.2f", name,
+	       (double)nsec / ops, (double)allocs / ops);
+	for (int i = 0; i < N_COUNTER; ++i)
+	{
+	    long long v = counters->value(i);
+	    if (v < 0)
+		printf(" %10s", "-");
+	    else
+		printf(" %10.1f", (double)v / ops);
+	}
+	printf("\n");
+	fflush(stdout);
+    }
+private:
+    uint64_t nsec, nsec_at;
+    unsigned long allocs, allocs_at;
+    unsigned long ops;
+};
+
+static void header(void)
+{
+    printf("%-28s %10s %8s", "benchmark", "ns/op", "alloc/op");
+    for (int i = 0; i < N_COUNTER; ++i)
+	printf(" %10s", counter_name[i]);
+    printf("\n");
+}
+
+// events are counted, not examined.
+static unsigned long events;
+static char last_cmd;
+
+static void nav(char cmd, string, string, string, string,
+		string, string, string, string)
+{
+    ++events;
+    last_cmd = cmd;
+}
+
+// the event interface hands out views: nothing is copied for us.
+static void event(const BibleSync_event &e, void *)
+{
+    ++events;
+    last_cmd = e.cmd;
+}
+
+// friend of BibleSync: reaches the private packet path.
+class BibleSyncBench {
+public:
+    BibleSyncBench(unsigned long s) : scale(s)
+    {
+	object = new BibleSync("bench", "1.0", "bencher");
+	object->setDumpMode(BSP_DUMP_OFF);
+	object->setMode(BSP_MODE_PERSONAL, nav, "BenchPhrase");
+
+	memset(&source, 0, sizeof(source));
+	source.sin_family = AF_INET;
+	source.sin_addr.s_addr = inet_addr("192.0.2.1");
+	source.sin_port = htons(BSP_PORT);
+    }
+    ~BibleSyncBench()
+    {
+	object->setMode(BSP_MODE_DISABLE);
+	delete object;
+    }
+
+    void receive(void);
+    void transmit(void);
+    void aging(unsigned int speakers);
+    void roundtrip(void);
+    int budget(void);
+    int ratelimit(void);
+
+private:
+    unsigned long scale;
+    BibleSync *object;
+    struct sockaddr_in source;
+
+    int compose(BibleSync::BibleSyncMessage &bsp, int type,
+		const uuid_t &uuid, const char *extra);
+};
+
+// a packet from a fixed peer, as a real one would send it.
+int BibleSyncBench::compose(BibleSync::BibleSyncMessage &bsp, int type,
+			    const uuid_t &uuid, const char *extra)
+{
+    char key[BSP_UUID_PRINT_LENGTH];
+
+    memset(&bsp, 0, sizeof(bsp));
+    bsp.magic = BSP_MAGIC;
+    bsp.version = BSP_PROTOCOL;
+    bsp.msg_type = type;
+    bsp.num_packets = 1;
+    bsp.index_packet = 0;
+    memcpy(&bsp.uuid, &uuid, sizeof(uuid_t));
+    object->uuid_dump(uuid, key);
+
+    int length = snprintf(bsp.body, sizeof(bsp.body),
+			  BSP_APP_NAME "=peer\n"
+			  BSP_APP_VERSION "=2.0\n"
+			  BSP_APP_INSTANCE_UUID "=%s\n"
+			  BSP_APP_OS "=Linux\n"
+			  BSP_APP_DEVICE "=x86_64: Linux @ peer\n"
+			  BSP_APP_USER "=peer user\n"
+			  BSP_MSG_PASSPHRASE "=BenchPhrase\n"
+			  "%s",
+			  key, extra);
+    return BSP_HEADER_SIZE + length;
+}
+
+// parse + validate + deliver, per message type, from one known,
+// listened-to speaker.  the network is not involved.
+void BibleSyncBench::receive(void)
+{
+    uuid_t peer;
+    BibleSync::BibleSyncMessage bsp;
+    static const struct {
+	const char *name;
+	int         type;
+	const char *extra;
+    } kind[] = {
+	{ "receive announce", BSP_ANNOUNCE, "" },
+	{ "receive sync", BSP_SYNC,
+	  BSP_MSG_SYNC_DOMAIN "=BIBLE-VERSE\n"
+	  BSP_MSG_SYNC_GROUP "=1\n"
+	  BSP_MSG_SYNC_BIBLEABBREV "=KJV\n"
+	  BSP_MSG_SYNC_ALTVERSE "=\n"
+	  BSP_MSG_SYNC_VERSE "=John.3.16\n" },
+	{ "receive beacon (known)", BSP_BEACON, "" },
+	{ "receive chat", BSP_CHAT,
+	  BSP_MSG_CHAT "=turn to page 12, please\n" },
+    };
+
+    object->uuid_gen(peer);
+
+    // become known, and listened to, as a real speaker would.
+    int length = compose(bsp, BSP_BEACON, peer, "");
+    object->ReceivePacket(bsp, length, source);
+    object->FindSpeaker(peer)->listen = true;
+
+    for (auto &k : kind)
+    {
+	Measure m;
+	unsigned long n = 200000 * scale;
+
+	length = compose(bsp, k.type, peer, k.extra);
+	m.start();
+	for (unsigned long i = 0; i < n; ++i)
+	    object->ReceivePacket(bsp, length, source);
+	m.stop(n);
+	m.report(k.name);
+    }
+
+    // the same sync in the other body encodings, as a peer would send it.
+    BibleSync *peer_object = new BibleSync("peer", "2.0", "peer user");
+    BibleSync::BibleSyncGather gather;
+    static const struct {
+	const char *name;
+	bool        tlv;
+    } encoding[] = {
+	{ "receive sync (compressed)", false },
+	{ "receive sync (TLV)", true },
+    };
+
+    peer_object->passphrase = "BenchPhrase";
+    length = compose(bsp, BSP_BEACON, peer_object->uuid, "");
+    object->ReceivePacket(bsp, length, source);
+    object->FindSpeaker(peer_object->uuid)->listen = true;
+
+    for (auto &e : encoding)
+    {
+	Measure m;
+	unsigned long n = 200000 * scale;
+
+	peer_object->setCompression(!e.tlv);
+	peer_object->setTLV(e.tlv);
+	peer_object->Gather(gather, BSP_SYNC,
+			    "KJV", "John.3.16", "", "1", "BIBLE-VERSE");
+	length = 0;
+	for (int i = 0; i < gather.count; ++i)
+	{
+	    memcpy((char *)&bsp + length, gather.iov[i].iov_base,
+		   gather.iov[i].iov_len);
+	    length += gather.iov[i].iov_len;
+	}
+
+	m.start();
+	for (unsigned long i = 0; i < n; ++i)
+	    object->ReceivePacket(bsp, length, source);
+	m.stop(n);
+	m.report(e.name);
+    }
+    delete peer_object;
+}
+
+// outbound: layout alone, then layout plus the send itself.
+void BibleSyncBench::transmit(void)
+{
+    unsigned long n = 200000 * scale;
+    BibleSync::BibleSyncGather gather;
+
+    {
+	Measure m;
+	m.start();
+	for (unsigned long i = 0; i < n; ++i)
+	    object->Gather(gather, BSP_SYNC,
+			   "KJV", "John.3.16", "", "1", "BIBLE-VERSE");
+	m.stop(n);
+	m.report("encode sync");
+    }
+    {
+	Measure m;
+	m.start();
+	for (unsigned long i = 0; i < n; ++i)
+	    object->Gather(gather, BSP_CHAT, "turn to page 12, please");
+	m.stop(n);
+	m.report("encode chat");
+    }
+
+    // the send is a syscall: fewer of them.
+    n = 20000 * scale;
+    {
+	Measure m;
+	m.start();
+	for (unsigned long i = 0; i < n; ++i)
+	    object->TransmitInternal(BSP_SYNC,
+				     "KJV", "John.3.16", "", "1", "BIBLE-VERSE");
+	m.stop(n);
+	m.report("transmit sync");
+    }
+    {
+	Measure m;
+	m.start();
+	for (unsigned long i = 0; i < n; ++i)
+	    object->TransmitInternal(BSP_BEACON);
+	m.stop(n);
+	m.report("transmit beacon");
+    }
+
+    // drain what we sent ourselves, uncounted.
+    while (object->ReceiveBatch() > 0)
+	;
+}
+
+// speaker aging, with every speaker beaconing on schedule:
+// simulated time runs a minute in wheel ticks; each speaker's
+// deadline moves on as its beacon would every beacon interval.
+// only the aging itself is timed.
+void BibleSyncBench::aging(unsigned int count)
+{
+    char name[64];
+    uint64_t now = now_nsec() / 1000000;
+
+    object->clearSpeakers();
+    object->wheel_now = now / BSP_WHEEL_MSEC;
+    for (unsigned int i = 0; i < count; ++i)
+    {
+	uuid_t u;
+	object->uuid_gen(u);
+	BibleSync::BibleSyncSpeaker &s = object->AddSpeaker(u);
+	BibleSync::BibleSyncTimer timer;
+	// beacons are spread evenly over the interval.
+	s.deadline = now + object->speaker_timeout
+	    - (i * (uint64_t)BSP_BEACON_MSEC / count);
+	s.serial = timer.serial = ++object->speaker_serial;
+	memcpy(&timer.uuid, &u, sizeof(uuid_t));
+	object->WheelInsert(timer, s.deadline);
+    }
+
+    Measure m;
+    unsigned long calls = 0;
+    for (uint64_t t = now; t < now + 60000; t += BSP_WHEEL_MSEC)
+    {
+	// beacons heard in this tick, untimed.
+	for (BibleSync::BibleSyncSpeaker &s : object->speakers)
+	    if (s.used &&
+		(s.deadline - object->speaker_timeout + BSP_BEACON_MSEC <= t))
+		s.deadline = t + object->speaker_timeout;
+
+	m.start();
+	object->ageSpeakers(t);
+	m.stop(1);
+	++calls;
+    }
+    snprintf(name, sizeof(name), "age %u speakers", count);
+    m.report(name);
+
+    if (object->speaker_count != count)
+	printf("  !! %u speakers died\n", count - object->speaker_count);
+    object->clearSpeakers();
+}
+
+// full loopback: Transmit() by one object until the other's
+// nav_func sees it, waiting in Receive(timeout).
+void BibleSyncBench::roundtrip(void)
+{
+    BibleSync *speaker = new BibleSync("bench", "1.0", "speaker");
+    BibleSync *audience = new BibleSync("bench", "1.0", "audience");
+    unsigned long n = 5000 * scale;
+
+    audience->setDumpMode(BSP_DUMP_OFF);
+    audience->setMode(BSP_MODE_AUDIENCE, nav, "RoundTrip");
+    speaker->setMode(BSP_MODE_SPEAKER, nav, "RoundTrip");
+
+    // audience hears the beacon, and listens to its first speaker.
+    last_cmd = 0;
+    for (int i = 0; (i < 100) && (last_cmd != 'S'); ++i)
+	BibleSync::Receive(audience, 10);
+
+    Measure m;
+    unsigned long lost = 0;
+    m.start();
+    for (unsigned long i = 0; i < n; ++i)
+    {
+	uint64_t give_up = now_nsec() + 100000000;	// 100ms: lost.
+
+	last_cmd = 0;
+	speaker->Transmit("KJV", "John.3.16");
+	while ((last_cmd != 'N') && (now_nsec() < give_up))
+	    BibleSync::Receive(audience, 10);
+	if (last_cmd != 'N')
+	    ++lost;
+    }
+    m.stop(n);
+    m.report("loopback round trip");
+    if (lost)
+	printf("  !! %lu lost\n", lost);
+
+    speaker->setMode(BSP_MODE_DISABLE);
+    audience->setMode(BSP_MODE_DISABLE);
+    delete speaker;
+    delete audience;
+}
+
+// steady state allocates nothing.  each step runs once to warm up
+// (first sight of a speaker, slot and scratch growth), then again
+// counted.  returns how many steps allocated.
+int BibleSyncBench::budget(void)
+{
+    BibleSync *quiet = new BibleSync("bench", "1.0", "budget");
+    BibleSync *saved = object;
+    BibleSync::BibleSyncMessage bsp;
+    uuid_t peer;
+    int failed = 0;
+    static const struct {
+	const char *name;
+	int         type;
+	const char *extra;
+    } kind[] = {
+	{ "receive announce", BSP_ANNOUNCE, "" },
+	{ "receive sync", BSP_SYNC,
+	  BSP_MSG_SYNC_DOMAIN "=BIBLE-VERSE\n"
+	  BSP_MSG_SYNC_GROUP "=1\n"
+	  BSP_MSG_SYNC_BIBLEABBREV "=KJV\n"
+	  BSP_MSG_SYNC_ALTVERSE "=\n"
+	  BSP_MSG_SYNC_VERSE "=John.3.16\n" },
+	{ "receive beacon (known)", BSP_BEACON, "" },
+	{ "receive chat", BSP_CHAT,
+	  BSP_MSG_CHAT "=turn to page 12, please\n" },
+	{ "receive junk", BSP_CHAT + 1, "" },
+    };
+
+    // dumps on, so that rendering them is covered too.
+    object = quiet;
+    quiet->setDumpMode(BSP_DUMP_ALWAYS);
+    quiet->setModeEvent(BSP_MODE_PERSONAL, event, NULL, "BenchPhrase");
+
+    quiet->uuid_gen(peer);
+    int length = compose(bsp, BSP_BEACON, peer, "");
+    quiet->ReceivePacket(bsp, length, source);
+    quiet->FindSpeaker(peer)->listen = true;
+
+    for (int pass = 0; pass < 2; ++pass)
+    {
+	for (auto &k : kind)
+	{
+	    unsigned long at = allocations;
+
+	    length = compose(bsp, k.type, peer, k.extra);
+	    for (int i = 0; i < 1000; ++i)
+		quiet->ReceivePacket(bsp, length, source);
+	    if (pass && (allocations != at))
+	    {
+		printf("  !! %s: %lu allocations\n", k.name, allocations - at);
+		++failed;
+	    }
+	}
+
+	unsigned long at = allocations;
+	for (int i = 0; i < 100; ++i)
+	{
+	    quiet->TransmitInternal(BSP_SYNC,
+				    "KJV", "John.3.16", "", "1", "BIBLE-VERSE");
+	    quiet->TransmitInternal(BSP_CHAT, "turn to page 12, please");
+	    quiet->TransmitInternal(BSP_BEACON);
+	}
+	if (pass && (allocations != at))
+	{
+	    printf("  !! transmit: %lu allocations\n", allocations - at);
+	    ++failed;
+	}
+	while (quiet->ReceiveBatch() > 0)
+	    ;
+    }
+
+    // aging: a whole turn of the wheel grows every slot to what it
+    // holds; a minute more is counted.
+    const uint64_t turn = (uint64_t)BSP_WHEEL_SLOTS * BSP_WHEEL_SLOTS
+			  * BSP_WHEEL_MSEC;
+    uint64_t now = now_nsec() / 1000000;
+    quiet->clearSpeakers();
+    quiet->wheel_now = now / BSP_WHEEL_MSEC;
+    for (unsigned int i = 0; i < 1000; ++i)
+    {
+	uuid_t u;
+	quiet->uuid_gen(u);
+	BibleSync::BibleSyncSpeaker &s = quiet->AddSpeaker(u);
+	BibleSync::BibleSyncTimer timer;
+	s.deadline = now + quiet->speaker_timeout
+	    - (i * (uint64_t)BSP_BEACON_MSEC / 1000);
+	s.serial = timer.serial = ++quiet->speaker_serial;
+	memcpy(&timer.uuid, &u, sizeof(uuid_t));
+	quiet->WheelInsert(timer, s.deadline);
+    }
+    unsigned long at = 0;
+    for (uint64_t t = now; t < now + turn + 60000; t += BSP_WHEEL_MSEC)
+    {
+	if (t == now + turn)
+	    at = allocations;
+	for (BibleSync::BibleSyncSpeaker &s : quiet->speakers)
+	    if (s.used &&
+		(s.deadline - quiet->speaker_timeout + BSP_BEACON_MSEC <= t))
+		s.deadline = t + quiet->speaker_timeout;
+	quiet->ageSpeakers(t);
+    }
+    if (allocations != at)
+    {
+	printf("  !! aging: %lu allocations\n", allocations - at);
+	++failed;
+    }
+
+    quiet->setMode(BSP_MODE_DISABLE);
+    delete quiet;
+    object = saved;
+    printf("allocation budget: %s\n", failed ? "exceeded" : "held");
+    return failed;
+}
+
+// our own echo, at and past the burst, from the address a peer on
+// this host shares.  the peer must still be heard.  returns 1 if not.
+int BibleSyncBench::ratelimit(void)
+{
+    BibleSync *limited = new BibleSync("bench", "1.0", "ratelimit");
+    BibleSync *saved = object;
+    BibleSync::BibleSyncMessage bsp;
+    uuid_t peer;
+    const unsigned int burst = 10;
+
+    object = limited;
+    limited->setDumpMode(BSP_DUMP_OFF);
+    limited->setModeEvent(BSP_MODE_PERSONAL, event, NULL, "BenchPhrase");
+    limited->setRateLimit(1, burst, 1, burst);
+
+    int length = compose(bsp, BSP_BEACON, limited->uuid, "");
+    for (unsigned int i = 0; i < 2 * burst; ++i)
+	limited->ReceivePacket(bsp, length, source);
+
+    limited->uuid_gen(peer);
+    length = compose(bsp, BSP_BEACON, peer, "");
+    limited->ReceivePacket(bsp, length, source);
+
+    bool heard = (limited->FindSpeaker(peer) != NULL);
+    uint64_t dropped = limited->stats[BSP_STAT_RATE_LIMITED].load();
+    if (dropped != 0)
+	printf("  !! %llu rate limited\n", (unsigned long long)dropped);
+
+    limited->setMode(BSP_MODE_DISABLE);
+    delete limited;
+    object = saved;
+    printf("rate limit, own echo: %s\n",
+	   heard ? "not charged" : "charged, peer dropped");
+    return (heard ? 0 : 1);
+}
+
+int main(int argc, char **argv)
+{
+    if ((argc > 1) && (strcmp(argv[1], "budget") == 0))
+    {
+	counters = new Counters();
+	BibleSyncBench bench(1);
+	int failed = bench.budget();
+	delete counters;
+	return (failed ? 1 : 0);
+    }
+    if ((argc > 1) && (strcmp(argv[1], "ratelimit") == 0))
+    {
+	counters = new Counters();
+	BibleSyncBench bench(1);
+	int failed = bench.ratelimit();
+	delete counters;
+	return failed;
+    }
+
+    unsigned long scale = ((argc > 1) ? strtoul(argv[1], NULL, 10) : 1);
+    if (scale == 0)
+	scale = 1;
+
+    counters = new Counters();
+    header();
+
+    BibleSyncBench bench(scale);
+    bench.receive();
+    bench.transmit();
+    bench.aging(10);
+    bench.aging(1000);
+    bench.aging(100000);
+    bench.roundtrip();
+
+    delete counters;
+    return 0;
+}
@@ -0,0 +1,420 @@
+/*
+ * BibleSync library
+ * bsp-flood.cc
+ *
+ * Synthetic load: a flood generator simulating many participants,
+ * and a companion receiver, using the library, that accounts for
+ * every packet.  Together they find Receive()'s throughput ceiling.
+ *
+ * generate: -s speakers beacon every -B msec and navigate -r times
+ * per second; -a audience members announce once and chat -c times
+ * per second.  participants are spread over -w worker threads, and
+ * each has its own UUID.  -F ignores cadence and sends flat-out.
+ * -e makes that percentage of navigation malformed (no group).
+ *	$ ./bsp_flood -g -s 20 -a 200 -w 4 -t 30 -r 10 [-F] [-e 1]
+ *
+ * receive: counts, per sender, what the library delivers, and
+ * reports what was lost, from sequence numbers carried in each
+ * navigation's alt ref and each chat ("flood:N").  -T uses the
+ * library's receiver thread.  ends after -t seconds, or 2 seconds
+ * of silence once traffic has started.
+ *	$ ./bsp_flood -m [-t 60] [-T]
+ *
+ * both: -p passphrase (default Flood).
+ * generate: -d destination address (default the BSP group),
+ * -i interface address.
+ *
+ * All files related to implementation of BibleSync, including program
+ * source, READMEs, manual pages, and related similar documents, are in
+ * the public domain.  As a matter of simple decency, your social
+ * obligations are to credit the source and to coordinate any changes you
+ * make back to the origin repository.  These obligations are non-
+ * binding for public domain software, but they are to be seriously
+ * handled nonetheless.
+ */
+
+#include <biblesync.hh>
+#include <atomic>
+#include <unordered_map>
+
+static const char *passphrase = "Flood";
+static const char *ifaddr = NULL;
+
+static uint64_t now_usec(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ((uint64_t)ts.tv_sec * 1000000) + (ts.tv_nsec / 1000);
+}
+
+//
+// generator.
+//
+
+typedef struct _participant {
+    bool     speaker;
+    uuid_t   uuid;
+    char     key[BSP_UUID_PRINT_LENGTH];
+    char     user[32];
+    uint64_t next_beacon;		// usec.
+    uint64_t next_send;			// nav or chat, usec.
+    uint64_t interval;			// between nav or chat, usec.
+    uint64_t seq;
+} participant;
+
+typedef struct _flood_options {
+    int      speakers, audience, workers, seconds;
+    double   nav_rate, chat_rate;
+    int      beacon_msec;
+    int      malformed;			// percent.
+    bool     flat_out;
+    const char *dest;
+} flood_options;
+
+static std::atomic<unsigned long> sent_total[5];	// by msg type.
+static std::atomic<unsigned long> sent_malformed;
+static std::atomic<unsigned long> send_failures;
+
+// framing as in send-test.c.
+static int compose(unsigned char *message, int type, participant &p,
+		   const char *extra)
+{
+    static const unsigned char header[] = {
+	0x40, 0x9c, 0xaf, 0x11, BSP_PROTOCOL, 0x00, 0x01, 0x00,
+	0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00
+    };
+
+    memcpy(message, header, sizeof(header));
+    message[5] = type;
+    memcpy(message + 16, &p.uuid, sizeof(uuid_t));
+    int length = snprintf((char *)message + BSP_HEADER_SIZE,
+			  BSP_MAX_PAYLOAD,
+			  BSP_APP_NAME "=bsp_flood\n"
+			  BSP_APP_VERSION "=1.0\n"
+			  BSP_APP_INSTANCE_UUID "=%s\n"
+			  BSP_APP_OS "=" BSP_OS "\n"
+			  BSP_APP_DEVICE "=flood\n"
+			  BSP_APP_USER "=%s\n"
+			  BSP_MSG_PASSPHRASE "=%s\n"
+			  "%s",
+			  p.key, p.user, passphrase, extra);
+    return BSP_HEADER_SIZE + min(length, BSP_MAX_PAYLOAD);
+}
+
+static void worker(const flood_options *opt, std::vector<participant> *mine,
+		   unsigned int seed)
+{
+    struct sockaddr_in group;
+    unsigned char message[BSP_MAX_SIZE];
+    char extra[256];
+    uint64_t end = now_usec() + (uint64_t)opt->seconds * 1000000;
+    int sd = socket(AF_INET, SOCK_DGRAM, 0);
+
+    if (sd < 0)
+    {
+	perror("opening datagram socket");
+	return;
+    }
+    if (ifaddr)
+    {
+	struct in_addr local_interface;
+	local_interface.s_addr = inet_addr(ifaddr);
+	setsockopt(sd, IPPROTO_IP, IP_MULTICAST_IF,
+		   (char *)&local_interface, sizeof(local_interface));
+    }
+    memset((char *) &group, 0, sizeof(group));
+    group.sin_family = AF_INET;
+    group.sin_addr.s_addr = inet_addr(opt->dest);
+    group.sin_port = htons(BSP_PORT);
+
+    auto ship = [&](int type, participant &p, const char *body) {
+	int length = compose(message, type, p, body);
+	if (sendto(sd, message, length, 0,
+		   (struct sockaddr *)&group, sizeof(group)) < 0)
+	    ++send_failures;
+	else
+	    ++sent_total[type];
+    };
+
+    // everyone makes themselves known first.
+    for (participant &p : *mine)
+	ship(p.speaker ? BSP_BEACON : BSP_ANNOUNCE, p, "");
+
+    while (now_usec() < end)
+    {
+	uint64_t now = now_usec();
+	uint64_t wake = end;
+
+	for (participant &p : *mine)
+	{
+	    if (p.speaker && (now >= p.next_beacon))
+	    {
+		ship(BSP_BEACON, p, "");
+		p.next_beacon = now + (uint64_t)opt->beacon_msec * 1000;
+	    }
+	    if ((p.interval != 0) && (opt->flat_out || (now >= p.next_send)))
+	    {
+		if (p.speaker)
+		{
+		    bool bad = ((int)(rand_r(&seed) % 100) < opt->malformed);
+		    snprintf(extra, sizeof(extra),
+			     BSP_MSG_SYNC_DOMAIN "=BIBLE-VERSE\n"
+			     "%s"
+			     BSP_MSG_SYNC_BIBLEABBREV "=KJV\n"
+			     BSP_MSG_SYNC_ALTVERSE "=flood:%llu\n"
+			     BSP_MSG_SYNC_VERSE "=Gen.1.1\n",
+			     (bad ? "" : BSP_MSG_SYNC_GROUP "=1\n"),
+			     (unsigned long long)p.seq++);
+		    if (bad)
+			++sent_malformed;
+		    ship(BSP_SYNC, p, extra);
+		}
+		else
+		{
+		    snprintf(extra, sizeof(extra),
+			     BSP_MSG_CHAT "=flood:%llu\n",
+			     (unsigned long long)p.seq++);
+		    ship(BSP_CHAT, p, extra);
+		}
+		p.next_send = now + p.interval;
+	    }
+	    if (p.speaker && (p.next_beacon < wake))
+		wake = p.next_beacon;
+	    if ((p.interval != 0) && (p.next_send < wake))
+		wake = p.next_send;
+	}
+
+	if (!opt->flat_out)
+	{
+	    now = now_usec();
+	    if (wake > now)
+		usleep(wake - now);
+	}
+    }
+    close(sd);
+}
+
+static int generate(flood_options &opt)
+{
+    int total = opt.speakers + opt.audience;
+    std::vector<std::vector<participant>> share(opt.workers);
+    uint64_t start = now_usec();
+
+    for (int i = 0; i < total; ++i)
+    {
+	participant p;
+	memset(&p, 0, sizeof(p));
+	p.speaker = (i < opt.speakers);
+	uuid_generate(p.uuid);
+	uuid_unparse(p.uuid, p.key);
+	snprintf(p.user, sizeof(p.user), "%s %d",
+		 (p.speaker ? "speaker" : "audience"), i);
+	double rate = (p.speaker ? opt.nav_rate : opt.chat_rate);
+	p.interval = ((rate > 0) ? (uint64_t)(1000000 / rate) : 0);
+	// spread first sends over one interval.
+	p.next_send = start + (p.interval ? (rand() % p.interval) : 0);
+	p.next_beacon = start + (uint64_t)opt.beacon_msec * 1000;
+	share[i % opt.workers].push_back(p);
+    }
+
+    std::vector<std::thread> workers;
+    for (int w = 0; w < opt.workers; ++w)
+	workers.emplace_back(worker, &opt, &share[w], (unsigned int)w + 1);
+    for (std::thread &t : workers)
+	t.join();
+
+    double elapsed = (double)(now_usec() - start) / 1e6;
+    unsigned long all = 0;
+    for (int t = BSP_ANNOUNCE; t <= BSP_CHAT; ++t)
+	all += sent_total[t];
+    printf("sent %lu packets in %.1f sec, %.0f/sec\n",
+	   all, elapsed, all / elapsed);
+    printf("  announce %lu, sync %lu (%lu malformed), beacon %lu, chat %lu\n",
+	   sent_total[BSP_ANNOUNCE].load(), sent_total[BSP_SYNC].load(),
+	   sent_malformed.load(), sent_total[BSP_BEACON].load(),
+	   sent_total[BSP_CHAT].load());
+    if (send_failures)
+	printf("  %lu send failures\n", send_failures.load());
+    return 0;
+}
+
+//
+// companion receiver.
+//
+
+typedef struct _sender_count {
+    uint64_t low, high;			// sequence range seen.
+    uint64_t received;
+} sender_count;
+
+static std::unordered_map<string, sender_count> senders;
+static unsigned long events[128];
+static BibleSync *receiver;
+static uint64_t last_traffic;
+
+static void count(char cmd, string speakerkey,
+		  string, string, string alt,
+		  string, string,
+		  string, string)
+{
+    events[(unsigned char)cmd & 127]++;
+    last_traffic = now_usec();
+
+    // hear every speaker, not only the first.
+    if (cmd == 'S')
+	receiver->listenToSpeaker(true, speakerkey);
+
+    if (((cmd == 'N') || (cmd == 'C') || (cmd == 'M')) &&
+	(alt.compare(0, 6, "flood:") == 0))
+    {
+	uint64_t seq = strtoull(alt.c_str() + 6, NULL, 10);
+	auto s = senders.find(speakerkey);
+	if (s == senders.end())
+	    senders[speakerkey] = { seq, seq, 1 };
+	else
+	{
+	    s->second.low = min(s->second.low, seq);
+	    s->second.high = max(s->second.high, seq);
+	    s->second.received++;
+	}
+    }
+}
+
+// system-wide UDP receive buffer overflows, from /proc; -1 if unknown.
+static long kernel_drops(void)
+{
+    FILE *f = fopen("/proc/net/snmp", "r");
+    char names[1024], values[1024];
+    long result = -1;
+
+    if (f == NULL)
+	return -1;
+    while (fgets(names, sizeof(names), f) &&
+	   fgets(values, sizeof(values), f))
+    {
+	if (strncmp(names, "Udp:", 4) != 0)
+	    continue;
+	char *n_save, *v_save;
+	char *n = strtok_r(names, " \n", &n_save);
+	char *v = strtok_r(values, " \n", &v_save);
+	while (n && v)
+	{
+	    if (strcmp(n, "RcvbufErrors") == 0)
+		result = atol(v);
+	    n = strtok_r(NULL, " \n", &n_save);
+	    v = strtok_r(NULL, " \n", &v_save);
+	}
+    }
+    fclose(f);
+    return result;
+}
+
+static int receive(int seconds, bool thread)
+{
+    BibleSync *object = receiver = new BibleSync("bsp_flood", "1.0", "receiver");
+    long drops_before = kernel_drops();
+    uint64_t start = now_usec();
+    uint64_t end = start + (uint64_t)seconds * 1000000;
+
+    object->setDumpMode(BSP_DUMP_OFF);
+    object->setReceiverThread(thread);
+    object->setMode(BSP_MODE_AUDIENCE, count, passphrase);
+
+    last_traffic = 0;
+    while (now_usec() < end)
+    {
+	BibleSync::Receive(object, 100);
+	if (thread)
+	    usleep(10000);
+
+	if ((last_traffic != 0) && (now_usec() - last_traffic > 2000000))
+	    break;			// 2 seconds of silence: done.
+    }
+    double elapsed = (double)(now_usec() - start) / 1e6;
+    long drops_after = kernel_drops();
+    object->setMode(BSP_MODE_DISABLE);
+
+    uint64_t expected = 0, received = 0;
+    for (auto &s : senders)
+    {
+	expected += s.second.high - s.second.low + 1;
+	received += s.second.received;
+    }
+    unsigned long delivered = 0;
+    for (unsigned long e : events)
+	delivered += e;
+
+    printf("%lu events in %.1f sec, %.0f/sec\n",
+	   delivered, elapsed, delivered / elapsed);
+    printf("  'S' %lu, 'A' %lu, 'N' %lu, 'C' %lu, 'M' %lu, 'D' %lu\n",
+	   events['S'], events['A'], events['N'], events['C'],
+	   events['M'], events['D']);
+    printf("  rejected by validation ('E'): %lu\n", events['E']);
+    // malformed packets use up sequence numbers too.
+    uint64_t gaps = expected - received;
+    uint64_t lost = ((gaps > events['E']) ? gaps - events['E'] : 0);
+    printf("  numbered from %zu senders: %llu received, %llu lost "
+	   "(%.2f%%)\n",
+	   senders.size(),
+	   (unsigned long long)received,
+	   (unsigned long long)lost,
+	   (expected ? 100.0 * lost / expected : 0.0));
+    if ((drops_before >= 0) && (drops_after >= 0))
+	printf("  kernel receive buffer drops (system-wide): %ld\n",
+	       drops_after - drops_before);
+    else
+	printf("  kernel receive buffer drops: unknown\n");
+
+    delete object;
+    return 0;
+}
+
+static void usage(void)
+{
+    fprintf(stderr,
+	    "usage: bsp_flood -g [-s speakers] [-a audience] [-w workers] "
+	    "[-t sec]\n"
+	    "                    [-r navs/sec] [-c chats/sec] [-B beacon_msec] "
+	    "[-e pct] [-F]\n"
+	    "                    [-d addr] [-i ifaddr] [-p passphrase]\n"
+	    "       bsp_flood -m [-t sec] [-T] [-p passphrase]\n");
+    exit(1);
+}
+
+int main(int argc, char *argv[])
+{
+    flood_options opt = {
+	10, 50, 2, 10,		// speakers, audience, workers, seconds.
+	10.0, 0.1,		// navs/sec/speaker, chats/sec/audience.
+	BSP_BEACON_MSEC, 0,	// beacon interval, malformed %.
+	false, BSP_MULTICAST
+    };
+    bool generating = false, measuring = false, thread = false;
+    int c;
+
+    while ((c = getopt(argc, argv, "gms:a:w:t:r:c:B:e:Fd:i:p:T")) != -1)
+    {
+	switch (c) {
+	case 'g': generating = true;			break;
+	case 'm': measuring = true;			break;
+	case 's': opt.speakers = atoi(optarg);		break;
+	case 'a': opt.audience = atoi(optarg);		break;
+	case 'w': opt.workers = max(1, atoi(optarg));	break;
+	case 't': opt.seconds = atoi(optarg);		break;
+	case 'r': opt.nav_rate = atof(optarg);		break;
+	case 'c': opt.chat_rate = atof(optarg);		break;
+	case 'B': opt.beacon_msec = atoi(optarg);	break;
+	case 'e': opt.malformed = atoi(optarg);		break;
+	case 'F': opt.flat_out = true;			break;
+	case 'd': opt.dest = optarg;			break;
+	case 'i': ifaddr = optarg;			break;
+	case 'p': passphrase = optarg;			break;
+	case 'T': thread = true;			break;
+	default:  usage();
+	}
+    }
+    if (generating == measuring)
+	usage();
+
+    return (generating ? generate(opt) : receive(opt.seconds, thread));
+}
@@ -0,0 +1,285 @@
+/*
+ * BibleSync library
+ * bsp-replay.c
+ *
+ * Capture and timed replay of raw BSP traffic, for load testing
+ * new library builds against a real session's packets.
+ *
+ * record: capture datagrams from the BSP multicast group, with
+ * arrival times, into a compact binary file, until interrupted
+ * or -n packets are had.
+ *	$ ./bsp_replay -r session.bsp [-i 192.168.1.27] [-n count]
+ *
+ * replay: re-inject a capture at original speed, N times speed
+ * (-x 4), or flat-out (-x 0), to the multicast group or to any
+ * other address such as loopback (-d 127.0.0.1).
+ *	$ ./bsp_replay -p session.bsp [-x speed] [-d addr] [-i 192.168.1.27]
+ *
+ * file format, all in host byte order (-p refuses a foreign one):
+ *	header: "BSPCAP1\n", uint32 0x01020304 (order check).
+ *	each packet: uint64 usec since capture start,
+ *		     uint32 source address (network order, as captured),
+ *		     uint16 length, then length bytes of datagram.
+ *
+ * All files related to implementation of BibleSync, including program
+ * source, READMEs, manual pages, and related similar documents, are in
+ * the public domain.  As a matter of simple decency, your social
+ * obligations are to credit the source and to coordinate any changes you
+ * make back to the origin repository.  These obligations are non-
+ * binding for public domain software, but they are to be seriously
+ * handled nonetheless.
+ */
+
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <arpa/inet.h>
+#include <netinet/in.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <memory.h>
+#include <string.h>
+#include <signal.h>
+#include <time.h>
+#include <unistd.h>
+
+#define	BSP_MULTICAST	"239.225.27.227"
+#define	BSP_PORT	22272
+#define	BSP_MAX_SIZE	1280
+
+#define	CAP_MAGIC	"BSPCAP1\n"
+#define	CAP_ORDER	0x01020304
+
+typedef struct _cap_record {
+    uint64_t usec;
+    uint32_t source;
+    uint16_t length;
+} __attribute__((packed)) cap_record;
+
+static volatile sig_atomic_t stop = 0;
+
+static void interrupted(int sig)
+{
+    (void)sig;
+    stop = 1;
+}
+
+static uint64_t now_usec(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ((uint64_t)ts.tv_sec * 1000000) + (ts.tv_nsec / 1000);
+}
+
+static void usage(void)
+{
+    fprintf(stderr,
+	    "usage: bsp_replay -r file [-i ifaddr] [-n count]\n"
+	    "       bsp_replay -p file [-x speed] [-d addr] [-i ifaddr]\n"
+	    "  -x speed: 1 original (default), N times as fast, 0 flat-out.\n");
+    exit(1);
+}
+
+/*
+ * capture everything on the BSP group until interrupted.
+ */
+static int record(const char *file, const char *ifaddr, long count)
+{
+    struct sockaddr_in group, source;
+    struct ip_mreq multicast_req;
+    socklen_t source_length;
+    unsigned char message[BSP_MAX_SIZE + 1];
+    uint32_t order = CAP_ORDER;
+    uint64_t start = 0;
+    long packets = 0, bytes = 0;
+    int sd, reuse = 1;
+    FILE *out;
+
+    sd = socket(AF_INET, SOCK_DGRAM, 0);
+    if (sd < 0) {
+	perror("opening datagram socket");
+	return 1;
+    }
+    if (setsockopt(sd, SOL_SOCKET, SO_REUSEADDR,
+		   (char *)&reuse, sizeof(reuse)) < 0) {
+	perror("setting SO_REUSEADDR");
+	return 1;
+    }
+
+    memset((char *) &group, 0, sizeof(group));
+    group.sin_family = AF_INET;
+    group.sin_addr.s_addr = htonl(INADDR_ANY);
+    group.sin_port = htons(BSP_PORT);
+    if (bind(sd, (struct sockaddr *)&group, sizeof(group)) < 0) {
+	perror("bind");
+	return 1;
+    }
+
+    multicast_req.imr_multiaddr.s_addr = inet_addr(BSP_MULTICAST);
+    multicast_req.imr_interface.s_addr =
+	(ifaddr ? inet_addr(ifaddr) : htonl(INADDR_ANY));
+    if (setsockopt(sd, IPPROTO_IP, IP_ADD_MEMBERSHIP,
+		   (char *)&multicast_req, sizeof(multicast_req)) < 0) {
+	perror("IP_ADD_MEMBERSHIP");
+	return 1;
+    }
+
+    out = fopen(file, "wb");
+    if (out == NULL) {
+	perror(file);
+	return 1;
+    }
+    fwrite(CAP_MAGIC, 1, strlen(CAP_MAGIC), out);
+    fwrite(&order, sizeof(order), 1, out);
+
+    /* no SA_RESTART: let recvfrom() be interrupted. */
+    {
+	struct sigaction sa;
+	memset(&sa, 0, sizeof(sa));
+	sa.sa_handler = interrupted;
+	sigaction(SIGINT, &sa, NULL);
+	sigaction(SIGTERM, &sa, NULL);
+    }
+
+    while (!stop && ((count == 0) || (packets < count)))
+    {
+	cap_record r;
+	ssize_t size;
+
+	source_length = sizeof(source);
+	size = recvfrom(sd, message, sizeof(message), 0,
+			(struct sockaddr *)&source, &source_length);
+	if (size < 0)
+	    continue;			/* interrupted, most likely. */
+	if (size > BSP_MAX_SIZE)
+	    size = BSP_MAX_SIZE;	/* no BSP datagram is larger. */
+
+	if (packets == 0)
+	    start = now_usec();
+	r.usec = now_usec() - start;
+	r.source = source.sin_addr.s_addr;
+	r.length = size;
+	fwrite(&r, sizeof(r), 1, out);
+	fwrite(message, 1, size, out);
+	++packets;
+	bytes += size;
+    }
+
+    fclose(out);
+    fprintf(stderr, "recorded %ld packets, %ld bytes, %.1f sec\n",
+	    packets, bytes, (double)(now_usec() - start) / 1e6);
+    return 0;
+}
+
+/*
+ * re-inject a capture, paced as recorded, scaled by speed.
+ */
+static int replay(const char *file, const char *dest, const char *ifaddr,
+		  double speed)
+{
+    struct sockaddr_in group;
+    struct in_addr local_interface;
+    unsigned char message[BSP_MAX_SIZE];
+    char magic[sizeof(CAP_MAGIC)];
+    uint32_t order;
+    uint64_t start, last = 0;
+    long packets = 0, failed = 0;
+    cap_record r;
+    int sd;
+    FILE *in;
+
+    in = fopen(file, "rb");
+    if (in == NULL) {
+	perror(file);
+	return 1;
+    }
+    if ((fread(magic, 1, strlen(CAP_MAGIC), in) != strlen(CAP_MAGIC)) ||
+	(memcmp(magic, CAP_MAGIC, strlen(CAP_MAGIC)) != 0) ||
+	(fread(&order, sizeof(order), 1, in) != 1) ||
+	(order != CAP_ORDER)) {
+	fprintf(stderr, "%s: not a capture from a host of this byte order\n",
+		file);
+	return 1;
+    }
+
+    sd = socket(AF_INET, SOCK_DGRAM, 0);
+    if (sd < 0) {
+	perror("opening datagram socket");
+	return 1;
+    }
+
+    memset((char *) &group, 0, sizeof(group));
+    group.sin_family = AF_INET;
+    group.sin_addr.s_addr = inet_addr(dest ? dest : BSP_MULTICAST);
+    group.sin_port = htons(BSP_PORT);
+
+    if (ifaddr) {
+	local_interface.s_addr = inet_addr(ifaddr);
+	if (setsockopt(sd, IPPROTO_IP, IP_MULTICAST_IF,
+		       (char *)&local_interface,
+		       sizeof(local_interface)) < 0) {
+	    perror("setting local interface");
+	    return 1;
+	}
+    }
+
+    start = now_usec();
+    while (fread(&r, sizeof(r), 1, in) == 1)
+    {
+	if ((r.length > sizeof(message)) ||
+	    (fread(message, 1, r.length, in) != r.length)) {
+	    fprintf(stderr, "%s: truncated or corrupt at packet %ld\n",
+		    file, packets);
+	    break;
+	}
+
+	if (speed > 0) {
+	    uint64_t due = start + (uint64_t)(r.usec / speed);
+	    uint64_t now = now_usec();
+	    if (due > now)
+		usleep(due - now);
+	}
+
+	if (sendto(sd, message, r.length, 0,
+		   (struct sockaddr *)&group, sizeof(group)) < 0)
+	    ++failed;
+	++packets;
+	last = r.usec;
+    }
+
+    fclose(in);
+    fprintf(stderr, "replayed %ld packets (%ld failed) in %.3f sec, "
+	    "recorded over %.3f sec\n",
+	    packets, failed, (double)(now_usec() - start) / 1e6,
+	    (double)last / 1e6);
+    return 0;
+}
+
+int main (int argc, char *argv[])
+{
+    const char *record_file = NULL, *replay_file = NULL;
+    const char *ifaddr = NULL, *dest = NULL;
+    double speed = 1.0;
+    long count = 0;
+    int c;
+
+    while ((c = getopt(argc, argv, "r:p:i:d:x:n:")) != -1)
+    {
+	switch (c) {
+	case 'r': record_file = optarg;		break;
+	case 'p': replay_file = optarg;		break;
+	case 'i': ifaddr = optarg;		break;
+	case 'd': dest = optarg;		break;
+	case 'x': speed = atof(optarg);		break;
+	case 'n': count = atol(optarg);		break;
+	default:  usage();
+	}
+    }
+
+    if ((record_file != NULL) == (replay_file != NULL))
+	usage();
+
+    return (record_file
+	    ? record(record_file, ifaddr, count)
+	    : replay(replay_file, dest, ifaddr, speed));
+}